@@ -0,0 +1,193 @@
+package lua;
+
+import java.io.ByteArrayOutputStream;
+import java.nio.ByteBuffer;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/**
+ * MessagePack encoding used to pass large tables as a single byte[].
+ * Lua tables passed to a byte[] parameter arrive packed, byte[] return values are unpacked into lua tables.
+ */
+public final class LuaPack {
+    private LuaPack(){}
+
+    public static byte[] pack(Object value){
+        Writer writer = new Writer();
+        writer.writeValue(value);
+        return writer.toByteArray();
+    }
+
+    public static Object unpack(byte[] data){
+        ByteBuffer buffer = ByteBuffer.wrap(data);
+        Object value = read(buffer);
+        if(buffer.hasRemaining())
+            throw new IllegalArgumentException("Trailing data after packed value");
+        return value;
+    }
+
+    private static final class Writer extends ByteArrayOutputStream {
+        private void writeBigEndian(long value, int bytes){
+            for(int i = bytes - 1; i >= 0; i--)
+                write((int) (value >>> (i * 8)) & 0xFF);
+        }
+        private void writeHeader(int length, int fixType, int fixMax, int type16, int type32){
+            if(length <= fixMax){
+                write(fixType | length);
+            }else if(length <= 0xFFFF){
+                write(type16);
+                writeBigEndian(length, 2);
+            }else{
+                write(type32);
+                writeBigEndian(length, 4);
+            }
+        }
+        private void writeInteger(long value){
+            if(value >= 0 && value <= 0x7F){
+                write((int) value);
+            }else if(value < 0 && value >= -32){
+                write((int) value & 0xFF);
+            }else if(value >= Byte.MIN_VALUE && value <= Byte.MAX_VALUE){
+                write(0xD0);
+                writeBigEndian(value, 1);
+            }else if(value >= Short.MIN_VALUE && value <= Short.MAX_VALUE){
+                write(0xD1);
+                writeBigEndian(value, 2);
+            }else if(value >= Integer.MIN_VALUE && value <= Integer.MAX_VALUE){
+                write(0xD2);
+                writeBigEndian(value, 4);
+            }else{
+                write(0xD3);
+                writeBigEndian(value, 8);
+            }
+        }
+        private void writeValue(Object value){
+            if(value == null){
+                write(0xC0);
+            }else if(value instanceof Boolean){
+                write((Boolean) value ? 0xC3 : 0xC2);
+            }else if(value instanceof Integer || value instanceof Long || value instanceof Short || value instanceof Byte){
+                writeInteger(((Number) value).longValue());
+            }else if(value instanceof Double || value instanceof Float){
+                write(0xCB);
+                writeBigEndian(Double.doubleToLongBits(((Number) value).doubleValue()), 8);
+            }else if(value instanceof String){
+                byte[] bytes = ((String) value).getBytes(StandardCharsets.UTF_8);
+                if(bytes.length <= 31){
+                    write(0xA0 | bytes.length);
+                }else if(bytes.length <= 0xFF){
+                    write(0xD9);
+                    write(bytes.length);
+                }else{
+                    writeHeader(bytes.length, 0xA0, 0, 0xDA, 0xDB);
+                }
+                write(bytes, 0, bytes.length);
+            }else if(value instanceof byte[]){
+                byte[] bytes = (byte[]) value;
+                if(bytes.length <= 0xFF){
+                    write(0xC4);
+                    write(bytes.length);
+                }else{
+                    writeHeader(bytes.length, 0, -1, 0xC5, 0xC6);
+                }
+                write(bytes, 0, bytes.length);
+            }else if(value instanceof Map){
+                Map<?, ?> map = (Map<?, ?>) value;
+                writeHeader(map.size(), 0x80, 15, 0xDE, 0xDF);
+                for(Map.Entry<?, ?> entry : map.entrySet()){
+                    writeValue(entry.getKey());
+                    writeValue(entry.getValue());
+                }
+            }else if(value instanceof List){
+                List<?> list = (List<?>) value;
+                writeHeader(list.size(), 0x90, 15, 0xDC, 0xDD);
+                for(Object element : list)
+                    writeValue(element);
+            }else if(value instanceof Object[]){
+                Object[] array = (Object[]) value;
+                writeHeader(array.length, 0x90, 15, 0xDC, 0xDD);
+                for(Object element : array)
+                    writeValue(element);
+            }else{
+                throw new IllegalArgumentException("Unsupported type " + value.getClass().getName());
+            }
+        }
+    }
+
+    private static Object readInteger(long value){
+        if(value >= Integer.MIN_VALUE && value <= Integer.MAX_VALUE)
+            return (int) value;
+        return value;
+    }
+
+    private static String readString(ByteBuffer buffer, int length){
+        String value = new String(buffer.array(), buffer.arrayOffset() + buffer.position(), length, StandardCharsets.UTF_8);
+        buffer.position(buffer.position() + length);
+        return value;
+    }
+
+    private static byte[] readBytes(ByteBuffer buffer, int length){
+        byte[] value = new byte[length];
+        buffer.get(value);
+        return value;
+    }
+
+    private static List<Object> readArray(ByteBuffer buffer, int length){
+        List<Object> list = new ArrayList<>(length);
+        for(int i = 0; i < length; i++)
+            list.add(read(buffer));
+        return list;
+    }
+
+    private static Map<Object, Object> readMap(ByteBuffer buffer, int length){
+        Map<Object, Object> map = new HashMap<>(length * 2);
+        for(int i = 0; i < length; i++){
+            Object key = read(buffer);
+            map.put(key, read(buffer));
+        }
+        return map;
+    }
+
+    private static Object read(ByteBuffer buffer){
+        int type = buffer.get() & 0xFF;
+        if(type <= 0x7F)
+            return type;
+        if(type >= 0xE0)
+            return (int) (byte) type;
+        if((type & 0xF0) == 0x80)
+            return readMap(buffer, type & 0x0F);
+        if((type & 0xF0) == 0x90)
+            return readArray(buffer, type & 0x0F);
+        if((type & 0xE0) == 0xA0)
+            return readString(buffer, type & 0x1F);
+        switch(type){
+            case 0xC0: return null;
+            case 0xC2: return false;
+            case 0xC3: return true;
+            case 0xC4: return readBytes(buffer, buffer.get() & 0xFF);
+            case 0xC5: return readBytes(buffer, buffer.getShort() & 0xFFFF);
+            case 0xC6: return readBytes(buffer, buffer.getInt());
+            case 0xCA: return (double) buffer.getFloat();
+            case 0xCB: return buffer.getDouble();
+            case 0xCC: return buffer.get() & 0xFF;
+            case 0xCD: return buffer.getShort() & 0xFFFF;
+            case 0xCE: return readInteger(buffer.getInt() & 0xFFFFFFFFL);
+            case 0xCF: return readInteger(buffer.getLong());
+            case 0xD0: return (int) buffer.get();
+            case 0xD1: return (int) buffer.getShort();
+            case 0xD2: return buffer.getInt();
+            case 0xD3: return readInteger(buffer.getLong());
+            case 0xD9: return readString(buffer, buffer.get() & 0xFF);
+            case 0xDA: return readString(buffer, buffer.getShort() & 0xFFFF);
+            case 0xDB: return readString(buffer, buffer.getInt());
+            case 0xDC: return readArray(buffer, buffer.getShort() & 0xFFFF);
+            case 0xDD: return readArray(buffer, buffer.getInt());
+            case 0xDE: return readMap(buffer, buffer.getShort() & 0xFFFF);
+            case 0xDF: return readMap(buffer, buffer.getInt());
+            default: throw new IllegalArgumentException("Unsupported type 0x" + Integer.toHexString(type));
+        }
+    }
+}
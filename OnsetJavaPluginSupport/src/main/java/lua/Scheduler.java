@@ -0,0 +1,115 @@
+package lua;
+
+/**
+ * Hashed timer wheel driven by the plugin's native tick hook.
+ * Link it with SetJavaTickHandler(java, "lua/Scheduler", "tick") and all timers share one JNI call per server tick.
+ * Tasks are intrusive list nodes, so scheduling a reused Task and advancing the wheel never allocate.
+ * Only use it from the server thread.
+ */
+public final class Scheduler {
+    private static final long RESOLUTION_MS = 10;
+    private static final int WHEEL_SIZE = 1024;
+    private static final int WHEEL_MASK = WHEEL_SIZE - 1;
+
+    private static final Task[] wheel = new Task[WHEEL_SIZE];
+    private static double timeMs = 0;
+    private static long currentSlot = 0;
+    private static Task cursor = null;
+
+    private Scheduler(){}
+
+    public static final class Task {
+        private final Runnable runnable;
+        private long deadline;
+        private long period;
+        private boolean scheduled;
+        private Task prev;
+        private Task next;
+        public Task(Runnable runnable){
+            this.runnable = runnable;
+        }
+        public boolean isScheduled(){
+            return scheduled;
+        }
+        public void cancel(){
+            if(scheduled)
+                unlink(this);
+        }
+    }
+
+    public static void tick(float deltaSeconds){
+        timeMs += deltaSeconds * 1000.0;
+        long targetSlot = (long) (timeMs / RESOLUTION_MS);
+        while(currentSlot < targetSlot){
+            currentSlot++;
+            cursor = wheel[(int) (currentSlot & WHEEL_MASK)];
+            while(cursor != null){
+                Task task = cursor;
+                cursor = task.next;
+                if(task.deadline > currentSlot)
+                    continue;
+                unlink(task);
+                if(task.period > 0)
+                    link(task, currentSlot + task.period);
+                try {
+                    task.runnable.run();
+                }catch (Throwable throwable){
+                    throwable.printStackTrace();
+                }
+            }
+        }
+    }
+
+    public static Task schedule(Runnable runnable, long delayMs){
+        Task task = new Task(runnable);
+        schedule(task, delayMs);
+        return task;
+    }
+
+    public static Task scheduleRepeating(Runnable runnable, long delayMs, long periodMs){
+        Task task = new Task(runnable);
+        scheduleRepeating(task, delayMs, periodMs);
+        return task;
+    }
+
+    public static void schedule(Task task, long delayMs){
+        scheduleRepeating(task, delayMs, 0);
+    }
+
+    public static void scheduleRepeating(Task task, long delayMs, long periodMs){
+        task.cancel();
+        task.period = periodMs > 0 ? toSlots(periodMs) : 0;
+        link(task, currentSlot + toSlots(delayMs));
+    }
+
+    private static long toSlots(long ms){
+        return Math.max(1, (ms + RESOLUTION_MS - 1) / RESOLUTION_MS);
+    }
+
+    private static void link(Task task, long deadline){
+        int index = (int) (deadline & WHEEL_MASK);
+        task.deadline = deadline;
+        task.scheduled = true;
+        // insert at the head so a slot that is currently being processed doesn't visit the task again
+        task.prev = null;
+        task.next = wheel[index];
+        if(task.next != null)
+            task.next.prev = task;
+        wheel[index] = task;
+    }
+
+    private static void unlink(Task task){
+        if(cursor == task)
+            cursor = task.next;
+        if(task.prev != null){
+            task.prev.next = task.next;
+        }else{
+            wheel[(int) (task.deadline & WHEEL_MASK)] = task.next;
+        }
+        if(task.next != null)
+            task.next.prev = task.prev;
+        task.prev = null;
+        task.next = null;
+        task.scheduled = false;
+    }
+}
@@ -10,9 +10,14 @@ typedef UINT(CALLBACK* JVMDLLFunction)(JavaVM**, void**, JavaVMInitArgs*);
 #include <functional>
 #include <sstream>
 #include "Plugin.hpp"
+#include "LuaPack.hpp"
+#include "Trace.hpp"
+#include "ScratchArena.hpp"
 
 void JLuaFunctionClose(JNIEnv* jenv, jobject instance) {
-	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv);
+	jclass clazz = jenv->GetObjectClass(instance);
+	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv, clazz);
+	jenv->DeleteLocalRef(clazz);
 	if (env == nullptr) {
 		return;
 	}
@@ -20,16 +25,116 @@ void JLuaFunctionClose(JNIEnv* jenv, jobject instance) {
 }
 
 jobjectArray JLuaFunctionCall(JNIEnv* jenv, jobject instance, jobjectArray args) {
-	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv);
+	jclass clazz = jenv->GetObjectClass(instance);
+	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv, clazz);
+	jenv->DeleteLocalRef(clazz);
 	if (env == nullptr) {
 		return NULL;
 	}
 	return env->LuaFunctionCall(instance, args);
 }
 
-JavaEnv::JavaEnv(std::string classPath) {
-	this->env = nullptr;
-	this->vm = nullptr;
+// handles pack the slot index into the low bits and the slot generation into the high bits
+static const int OBJECT_HANDLE_INDEX_BITS = 20;
+static const uint32_t OBJECT_HANDLE_INDEX_MASK = (1u << OBJECT_HANDLE_INDEX_BITS) - 1;
+static const uint32_t OBJECT_HANDLE_GENERATION_MASK = 0x7FF;
+
+static int JavaObjectGC(lua_State* L) {
+	JavaObjectHandle* object = (JavaObjectHandle*)luaL_checkudata(L, 1, "JavaObject");
+	JavaEnv* env = Plugin::Get()->GetJavaEnv(object->javaId);
+	if (env != nullptr) {
+		env->ReleaseObjectHandle(object->handle);
+	}
+	return 0;
+}
+
+// bootstrap classes never unload, so these stay valid for the lifetime of the JVM
+static jclass stringClass;
+static jclass integerClass;
+static jclass doubleClass;
+static jclass booleanClass;
+static jclass listClass;
+static jclass mapClass;
+static jclass hashMapClass;
+static jmethodID integerInit;
+static jmethodID doubleInit;
+static jmethodID booleanInit;
+static jmethodID hashMapInit;
+static jmethodID hashMapPutMethod;
+static jclass numberClass;
+static jclass longClass;
+static jclass shortClass;
+static jclass byteClass;
+static jmethodID longValueMethod;
+static jmethodID doubleValueMethod;
+static jmethodID booleanValueMethod;
+static jmethodID listSizeMethod;
+static jmethodID listGetMethod;
+static jmethodID mapGetMethod;
+static jmethodID mapKeySetMethod;
+static jmethodID setToArrayMethod;
+static jclass classClass;
+static jmethodID forNameMethod;
+static jclass threadClass;
+static jmethodID currentThreadMethod;
+static jmethodID setContextClassLoaderMethod;
+static jclass futureClass;
+static jmethodID futureIsDoneMethod;
+static jmethodID futureGetMethod;
+
+static jclass CacheClass(JNIEnv* jenv, const char* className) {
+	jclass clazz = jenv->FindClass(className);
+	jclass globalClass = (jclass)jenv->NewGlobalRef(clazz);
+	jenv->DeleteLocalRef(clazz);
+	return globalClass;
+}
+
+static void CacheClasses(JNIEnv* jenv) {
+	stringClass = CacheClass(jenv, "java/lang/String");
+	integerClass = CacheClass(jenv, "java/lang/Integer");
+	doubleClass = CacheClass(jenv, "java/lang/Double");
+	numberClass = CacheClass(jenv, "java/lang/Number");
+	longClass = CacheClass(jenv, "java/lang/Long");
+	shortClass = CacheClass(jenv, "java/lang/Short");
+	byteClass = CacheClass(jenv, "java/lang/Byte");
+	booleanClass = CacheClass(jenv, "java/lang/Boolean");
+	listClass = CacheClass(jenv, "java/util/List");
+	mapClass = CacheClass(jenv, "java/util/Map");
+	hashMapClass = CacheClass(jenv, "java/util/HashMap");
+	classClass = CacheClass(jenv, "java/lang/Class");
+	threadClass = CacheClass(jenv, "java/lang/Thread");
+	futureClass = CacheClass(jenv, "java/util/concurrent/Future");
+	jclass setClass = jenv->FindClass("java/util/Set");
+	integerInit = jenv->GetMethodID(integerClass, "<init>", "(I)V");
+	doubleInit = jenv->GetMethodID(doubleClass, "<init>", "(D)V");
+	booleanInit = jenv->GetMethodID(booleanClass, "<init>", "(Z)V");
+	hashMapInit = jenv->GetMethodID(hashMapClass, "<init>", "()V");
+	hashMapPutMethod = jenv->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+	longValueMethod = jenv->GetMethodID(numberClass, "longValue", "()J");
+	doubleValueMethod = jenv->GetMethodID(numberClass, "doubleValue", "()D");
+	booleanValueMethod = jenv->GetMethodID(booleanClass, "booleanValue", "()Z");
+	listSizeMethod = jenv->GetMethodID(listClass, "size", "()I");
+	listGetMethod = jenv->GetMethodID(listClass, "get", "(I)Ljava/lang/Object;");
+	mapGetMethod = jenv->GetMethodID(mapClass, "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
+	mapKeySetMethod = jenv->GetMethodID(mapClass, "keySet", "()Ljava/util/Set;");
+	setToArrayMethod = jenv->GetMethodID(setClass, "toArray", "()[Ljava/lang/Object;");
+	currentThreadMethod = jenv->GetStaticMethodID(threadClass, "currentThread", "()Ljava/lang/Thread;");
+	setContextClassLoaderMethod = jenv->GetMethodID(threadClass, "setContextClassLoader", "(Ljava/lang/ClassLoader;)V");
+	futureIsDoneMethod = jenv->GetMethodID(futureClass, "isDone", "()Z");
+	futureGetMethod = jenv->GetMethodID(futureClass, "get", "()Ljava/lang/Object;");
+	forNameMethod = jenv->GetStaticMethodID(classClass, "forName", "(Ljava/lang/String;ZLjava/lang/ClassLoader;)Ljava/lang/Class;");
+	jenv->DeleteLocalRef(setClass);
+}
+
+static const int MAX_TABLE_DEPTH = 64;
+
+JavaVM* JavaEnv::vm = nullptr;
+JNIEnv* JavaEnv::env = nullptr;
+JavaEnv* JavaEnv::contextEnv = nullptr;
+
+bool JavaEnv::StartVM() {
+	if (vm != nullptr)
+		return true;
 #ifdef _WIN32
 	char inputJdkDll[] = "%JAVA_HOME%\\jre\\bin\\server\\jvm.dll";
 	TCHAR outputJdkDll[32000];
@@ -39,7 +144,7 @@ JavaEnv::JavaEnv(std::string classPath) {
 	DWORD jreResult = ExpandEnvironmentStrings((LPCTSTR)inputJreDll, outputJreDll, sizeof(outputJreDll) / sizeof(*outputJreDll));
 	if (!jdkResult && !jreResult) {
 		Onset::Plugin::Get()->Log("Failed to find JDK/JRE jvm.dll, please ensure Java 8 is installed.");
-		return;
+		return false;
 	}
 	HINSTANCE jvmDLL = LoadLibrary(outputJdkDll);
 	if (!jvmDLL) {
@@ -47,39 +152,61 @@ JavaEnv::JavaEnv(std::string classPath) {
 
 		if (!jvmDLL) {
 			Onset::Plugin::Get()->Log("Failed to find JDK/JRE jvm.dll, please ensure Java 8 is installed.");
-			return;
+			return false;
 		}
 	}
 	JVMDLLFunction createJavaVMFunction = (JVMDLLFunction)GetProcAddress(jvmDLL, "JNI_CreateJavaVM");
 	if (!createJavaVMFunction) {
 		Onset::Plugin::Get()->Log("Failed to find JDK/JRE jvm.dll, please ensure Java 8 is installed.");
-		return;
+		return false;
 	}
 #endif
 
-	static std::stringstream optionString;
-	optionString << "-Djava.class.path=" << classPath;
-
+	// the classpath of each JavaEnv lives in its own class loader, the JVM itself only needs the JDK
 	JavaVMInitArgs vm_args;
-	auto* options = new JavaVMOption[1];
-	char cpoptionString[200] = "";
-	std::strcpy(cpoptionString, optionString.str().c_str());
-
-	options[0].optionString = cpoptionString;
 	vm_args.version = JNI_VERSION_1_8;
-	vm_args.nOptions = 1;
-	vm_args.options = options;
+	vm_args.nOptions = 0;
+	vm_args.options = nullptr;
 	vm_args.ignoreUnrecognized = false;
 
 #ifdef __linux__ 
-	int res = JNI_CreateJavaVM(&this->vm, (void**)&this->env, &vm_args);
+	int res = JNI_CreateJavaVM(&vm, (void**)&env, &vm_args);
 #elif _WIN32
-	int res = createJavaVMFunction(&this->vm, (void**)&this->env, &vm_args);
-	printf("CreateJava Return: %d", res);
+	int res = createJavaVMFunction(&vm, (void**)&env, &vm_args);
 #endif
+	if (res != JNI_OK) {
+		Onset::Plugin::Get()->Log("Failed to create the JVM.");
+		vm = nullptr;
+		env = nullptr;
+		return false;
+	}
+	CacheClasses(env);
+	return true;
+}
 
-	this->luaFunctionClass = this->env->FindClass("lua/LuaFunction");
-	if (this->luaFunctionClass != NULL) {
+JavaEnv::JavaEnv(int id, std::string classPath) {
+	this->id = id;
+	this->classLoader = NULL;
+	this->luaFunctionClass = NULL;
+	this->luaFunctionInit = nullptr;
+	this->luaFunctionIdField = nullptr;
+	this->nextLuaFunctionId = 1;
+	this->tickClass = NULL;
+	this->tickMethod = nullptr;
+	if (!StartVM())
+		return;
+
+	this->classLoader = this->CreateClassLoader(classPath);
+	if (this->classLoader == NULL) {
+		Onset::Plugin::Get()->Log("Failed to create the class loader for CreateJava.");
+		return;
+	}
+
+	jclass luaFunctionClass = this->FindClass("lua/LuaFunction");
+	if (luaFunctionClass != NULL) {
+		this->luaFunctionClass = (jclass)this->env->NewGlobalRef(luaFunctionClass);
+		this->luaFunctionInit = this->env->GetMethodID(this->luaFunctionClass, "<init>", "()V");
+		this->luaFunctionIdField = this->env->GetFieldID(this->luaFunctionClass, "f", "I");
 		JNINativeMethod methods[] = {
 			{(char*)"close", (char*)"()V", (void*)JLuaFunctionClose },
 			{(char*)"call", (char*)"([Ljava/lang/Object;)[Ljava/lang/Object;", (void*)JLuaFunctionCall }
@@ -88,108 +215,283 @@ JavaEnv::JavaEnv(std::string classPath) {
 	}
 }
 
+jobject JavaEnv::CreateClassLoader(const std::string& classPath) {
+#ifdef _WIN32
+	const char separator = ';';
+#else
+	const char separator = ':';
+#endif
+	std::vector<std::string> entries;
+	std::stringstream classPathStream(classPath);
+	std::string entry;
+	while (std::getline(classPathStream, entry, separator)) {
+		if (!entry.empty())
+			entries.push_back(entry);
+	}
+
+	if (this->env->PushLocalFrame(20) != JNI_OK)
+		return NULL;
+	jclass fileClass = this->env->FindClass("java/io/File");
+	jmethodID fileInit = this->env->GetMethodID(fileClass, "<init>", "(Ljava/lang/String;)V");
+	jmethodID toURIMethod = this->env->GetMethodID(fileClass, "toURI", "()Ljava/net/URI;");
+	jclass uriClass = this->env->FindClass("java/net/URI");
+	jmethodID toURLMethod = this->env->GetMethodID(uriClass, "toURL", "()Ljava/net/URL;");
+	jclass urlClass = this->env->FindClass("java/net/URL");
+	jobjectArray urls = this->env->NewObjectArray((jsize)entries.size(), urlClass, NULL);
+	for (size_t i = 0; i < entries.size(); i++) {
+		jstring path = this->env->NewStringUTF(entries[i].c_str());
+		jobject file = this->env->NewObject(fileClass, fileInit, path);
+		jobject uri = this->env->CallObjectMethod(file, toURIMethod);
+		jobject url = this->env->CallObjectMethod(uri, toURLMethod);
+		if (this->env->ExceptionCheck()) {
+			this->env->ExceptionClear();
+		}
+		else {
+			this->env->SetObjectArrayElement(urls, (jsize)i, url);
+		}
+		this->env->DeleteLocalRef(path);
+		this->env->DeleteLocalRef(file);
+		this->env->DeleteLocalRef(uri);
+		this->env->DeleteLocalRef(url);
+	}
+	// the platform loader (Java 9+) adds modules like java.sql that the bootstrap loader doesn't see,
+	// neither of them sees the application classpath, so packages can't see each other's classes
+	jobject parent = NULL;
+	jclass classLoaderClass = this->env->FindClass("java/lang/ClassLoader");
+	jmethodID platformLoaderMethod = this->env->GetStaticMethodID(classLoaderClass, "getPlatformClassLoader", "()Ljava/lang/ClassLoader;");
+	if (platformLoaderMethod == nullptr) {
+		// Java 8, every class of the runtime is on the bootstrap loader there
+		this->env->ExceptionClear();
+	}
+	else {
+		parent = this->env->CallStaticObjectMethod(classLoaderClass, platformLoaderMethod);
+	}
+	jclass loaderClass = this->env->FindClass("java/net/URLClassLoader");
+	jmethodID loaderInit = this->env->GetMethodID(loaderClass, "<init>", "([Ljava/net/URL;Ljava/lang/ClassLoader;)V");
+	jobject loader = this->env->NewObject(loaderClass, loaderInit, urls, parent);
+	if (this->env->ExceptionCheck()) {
+		this->env->ExceptionDescribe();
+		this->env->ExceptionClear();
+		loader = NULL;
+	}
+	loader = this->env->PopLocalFrame(loader);
+	if (loader == NULL)
+		return NULL;
+	jobject globalLoader = this->env->NewGlobalRef(loader);
+	this->env->DeleteLocalRef(loader);
+	return globalLoader;
+}
+
+jclass JavaEnv::FindClass(const char* className) {
+	// the key buffer keeps its capacity, so lookups of known classes don't allocate
+	this->classKey.assign(className);
+	auto cached = this->classes.find(this->classKey);
+	if (cached != this->classes.end())
+		return cached->second;
+	ScratchArena::Scope scratch;
+	size_t length = this->classKey.length();
+	char* name = ScratchArena::Get().Allocate<char>(length + 1);
+	for (size_t i = 0; i <= length; i++) {
+		name[i] = className[i] == '/' ? '.' : className[i];
+	}
+	jstring jname = this->env->NewStringUTF(name);
+	jclass clazz = (jclass)this->env->CallStaticObjectMethod(classClass, forNameMethod, jname, JNI_TRUE, this->classLoader);
+	this->env->DeleteLocalRef(jname);
+	if (this->env->ExceptionCheck()) {
+		this->env->ExceptionClear();
+		return NULL;
+	}
+	jclass globalClass = (jclass)this->env->NewGlobalRef(clazz);
+	this->env->DeleteLocalRef(clazz);
+	this->classes.emplace(this->classKey, globalClass);
+	return globalClass;
+}
+
+static void SetContextClassLoader(JNIEnv* jenv, jobject loader) {
+	jobject thread = jenv->CallStaticObjectMethod(threadClass, currentThreadMethod);
+	jenv->CallVoidMethod(thread, setContextClassLoaderMethod, loader);
+	jenv->DeleteLocalRef(thread);
+}
+
+void JavaEnv::EnterContext() {
+	// libraries using the context class loader (ServiceLoader, JDBC drivers, ...) need to see this env's classpath
+	if (contextEnv == this)
+		return;
+	SetContextClassLoader(this->env, this->classLoader);
+	contextEnv = this;
+}
+
+void JavaEnv::Destroy() {
+	if (this->classLoader == NULL)
+		return;
+	for (auto const& function : this->luaFunctions) {
+		ReleaseLuaFunction(function.second);
+	}
+	this->luaFunctions.clear();
+	for (auto const& slot : this->objects) {
+		if (slot.object != NULL)
+			this->env->DeleteGlobalRef(slot.object);
+	}
+	this->objects.clear();
+	this->freeObjectSlots.clear();
+	for (auto const& entry : this->classes) {
+		this->env->DeleteGlobalRef(entry.second);
+	}
+	this->classes.clear();
+	if (this->tickClass != NULL) {
+		this->env->DeleteGlobalRef(this->tickClass);
+		this->tickClass = NULL;
+		this->tickMethod = nullptr;
+	}
+	if (this->luaFunctionClass != NULL) {
+		this->env->UnregisterNatives(this->luaFunctionClass);
+		this->env->DeleteGlobalRef(this->luaFunctionClass);
+		this->luaFunctionClass = NULL;
+	}
+	if (contextEnv == this) {
+		SetContextClassLoader(this->env, NULL);
+		contextEnv = nullptr;
+	}
+	jclass loaderClass = this->env->GetObjectClass(this->classLoader);
+	jmethodID closeMethod = this->env->GetMethodID(loaderClass, "close", "()V");
+	this->env->CallVoidMethod(this->classLoader, closeMethod);
+	if (this->env->ExceptionCheck())
+		this->env->ExceptionClear();
+	this->env->DeleteLocalRef(loaderClass);
+	this->env->DeleteGlobalRef(this->classLoader);
+	this->classLoader = NULL;
+}
+
+void JavaEnv::ReleaseLuaFunction(const LuaFunctionRef& function) {
+	// packages release their functions before they unload, so the state is still open here
+	lua_State* L = Plugin::Get()->GetPackageState(function.packageId);
+	if (L != nullptr)
+		luaL_unref(L, LUA_REGISTRYINDEX, function.ref);
+}
+
 void JavaEnv::LuaFunctionClose(jobject instance) {
-	jfieldID fField = this->env->GetFieldID(this->luaFunctionClass, "f", "I");
-	int id = this->env->GetIntField(instance, fField);
-	this->luaFunctions[id] = NULL;
+	int id = this->env->GetIntField(instance, this->luaFunctionIdField);
+	auto function = this->luaFunctions.find(id);
+	if (function == this->luaFunctions.end()) return;
+	ReleaseLuaFunction(function->second);
+	this->luaFunctions.erase(function);
+}
+
+void JavaEnv::ReleasePackage(int packageId) {
+	for (auto it = this->luaFunctions.begin(); it != this->luaFunctions.end();) {
+		if (it->second.packageId == packageId) {
+			ReleaseLuaFunction(it->second);
+			it = this->luaFunctions.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
 }
 
 jobjectArray JavaEnv::LuaFunctionCall(jobject instance, jobjectArray args) {
-	jfieldID fField = this->env->GetFieldID(this->luaFunctionClass, "f", "I");
-	jfieldID pField = this->env->GetFieldID(this->luaFunctionClass, "p", "Ljava/lang/String;");
-	int id = this->env->GetIntField(instance, fField);
-	jstring packageName = (jstring)this->env->GetObjectField(instance, pField);
-	const char* packageNameStr = this->env->GetStringUTFChars(packageName, nullptr);
-	lua_State* L = Plugin::Get()->GetPackageState(packageNameStr);
-	this->env->ReleaseStringUTFChars(packageName, packageNameStr);
-	this->env->DeleteLocalRef(packageName);
+	int id = this->env->GetIntField(instance, this->luaFunctionIdField);
+	auto function = this->luaFunctions.find(id);
+	if (function == this->luaFunctions.end()) return NULL;
+	lua_State* L = Plugin::Get()->GetPackageState(function->second.packageId);
+	if (L == nullptr) return NULL;
+	Trace::Scope trace("java->lua", "LuaFunction.call");
+	ScratchArena::Scope scratch;
 	int argsLength = this->env->GetArrayLength(args);
-	Lua::PushValueToLua(this->luaFunctions[id], L);
+	// the state may be in the middle of a lua -> java call whose arguments are still on the stack
+	int top = lua_gettop(L);
+	if (!lua_checkstack(L, argsLength + 1)) return NULL;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, function->second.ref);
 	for (jsize i = 0; i < argsLength; i++) {
-		Lua::PushValueToLua(this->ToLuaValue(this->env->GetObjectArrayElement(args, i)), L);
+		if (!this->PushLuaValue(L, this->env->GetObjectArrayElement(args, i))) {
+			lua_settop(L, top);
+			return NULL;
+		}
 	}
-	Lua::LuaArgs_t ReturnValues;
+	trace.BeginExecution();
 	int status = lua_pcall(L, argsLength, LUA_MULTRET, 0);
+	trace.EndExecution();
 	if (status == LUA_OK) {
-		Lua::ParseArguments(L, ReturnValues);
-		size_t returnCount = ReturnValues.size();
-		lua_pop(L, (int)returnCount);
+		// only the returns are converted, anything below top belongs to an outer call
+		int returnCount = lua_gettop(L) - top;
 		jclass objectCls = this->env->FindClass("Ljava/lang/Object;");
 		jobjectArray returns = this->env->NewObjectArray((jsize)returnCount, objectCls, NULL);
-		for (jsize i = 0; i < (int)returnCount; i++) {
-			jobject o = this->ToJavaObject(L, ReturnValues[i]);
+		for (jsize i = 0; i < returnCount; i++) {
+			jobject o = this->ToJavaObject(L, top + i + 1);
 			this->env->SetObjectArrayElement(returns, i, o);
-			this->env->DeleteGlobalRef(o);
+			this->env->DeleteLocalRef(o);
 		}
-		this->env->DeleteGlobalRef(objectCls);
+		lua_settop(L, top);
+		this->env->DeleteLocalRef(objectCls);
 		return returns;
 	}
+	// drops the error message
+	lua_settop(L, top);
 	return NULL;
 }
 
-jobject JavaEnv::ToJavaObject(lua_State* L, Lua::LuaValue value)
+jobject JavaEnv::ToJavaObject(lua_State* L, int index, int depth)
 {
+	// converts straight from the lua stack, without building intermediate LuaValues/LuaTables
 	JNIEnv* jenv = this->GetEnv();
-	switch (value.GetType())
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index))
 	{
-	case Lua::LuaValue::Type::STRING:
-	{
-		return (jobject)jenv->NewStringUTF(value.GetValue<std::string>().c_str());
-	} break;
-	case Lua::LuaValue::Type::INTEGER:
+	case LUA_TSTRING:
 	{
-		jclass jcls = jenv->FindClass("java/lang/Integer");
-		return jenv->NewObject(jcls, jenv->GetMethodID(jcls, "<init>", "(I)V"), value.GetValue<int>());
+		return (jobject)jenv->NewStringUTF(lua_tostring(L, index));
 	} break;
-	case Lua::LuaValue::Type::NUMBER:
+	case LUA_TNUMBER:
 	{
-		jclass jcls = jenv->FindClass("java/lang/Double");
-		return jenv->NewObject(jcls, jenv->GetMethodID(jcls, "<init>", "(D)V"), value.GetValue<double>());
+		if (lua_isinteger(L, index))
+			return jenv->NewObject(integerClass, integerInit, (jint)lua_tointeger(L, index));
+		return jenv->NewObject(doubleClass, doubleInit, (jdouble)lua_tonumber(L, index));
 	} break;
-	case Lua::LuaValue::Type::BOOLEAN:
+	case LUA_TBOOLEAN:
 	{
-		jclass jcls = jenv->FindClass("java/lang/Boolean");
-		return jenv->NewObject(jcls, jenv->GetMethodID(jcls, "<init>", "(Z)V"), value.GetValue<bool>());
+		return jenv->NewObject(booleanClass, booleanInit, (jboolean)lua_toboolean(L, index));
 	} break;
-	case Lua::LuaValue::Type::TABLE:
+	case LUA_TTABLE:
 	{
-		jclass jcls = jenv->FindClass("java/util/HashMap");
-		jobject jmap = jenv->NewObject(jcls, jenv->GetMethodID(jcls, "<init>", "()V"));
-		jmethodID putMethod = jenv->GetMethodID(jcls, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-
-		Lua::LuaTable_t table = value.GetValue<Lua::LuaTable_t>();
-		table->ForEach([jenv, this, L, jmap, putMethod](Lua::LuaValue k, Lua::LuaValue v) {
-			jobject jk = this->ToJavaObject(L, k);
-			jobject jv = this->ToJavaObject(L, v);
-			jenv->CallObjectMethod(jmap, putMethod, jk, jv);
-			jenv->DeleteGlobalRef(jk);
-			jenv->DeleteGlobalRef(jv);
-		});
-
+		// lua tables may reference themselves
+		if (depth >= MAX_TABLE_DEPTH || !lua_checkstack(L, 2))
+			return NULL;
+		jobject jmap = jenv->NewObject(hashMapClass, hashMapInit);
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			jobject jk = this->ToJavaObject(L, -2, depth + 1);
+			jobject jv = this->ToJavaObject(L, -1, depth + 1);
+			jobject previous = jenv->CallObjectMethod(jmap, hashMapPutMethod, jk, jv);
+			jenv->DeleteLocalRef(previous);
+			jenv->DeleteLocalRef(jk);
+			jenv->DeleteLocalRef(jv);
+			lua_pop(L, 1);
+		}
 		return jmap;
 	} break;
-	case Lua::LuaValue::Type::FUNCTION:
+	case LUA_TFUNCTION:
 	{
 		if (this->luaFunctionClass == NULL)
 			return NULL;
-		std::string packageNameStr = Plugin::Get()->GetStatePackage(L);
-		jstring packageName = this->env->NewStringUTF(packageNameStr.c_str());
-		jobject javaLuaFunction = jenv->NewObject(this->luaFunctionClass, jenv->GetMethodID(this->luaFunctionClass, "<init>", "()V"));
-		int id = 1;
-		while (this->luaFunctions.count(id)) {
-			id++;
-		}
-		this->luaFunctions[id] = value;
-		jfieldID fField = this->env->GetFieldID(this->luaFunctionClass, "f", "I");
-		this->env->SetIntField(javaLuaFunction, fField, id);
-		jfieldID pField = this->env->GetFieldID(this->luaFunctionClass, "p", "Ljava/lang/String;");
-		this->env->SetObjectField(javaLuaFunction, pField, packageName);
-		this->env->DeleteGlobalRef(packageName);
+		jobject javaLuaFunction = jenv->NewObject(this->luaFunctionClass, this->luaFunctionInit);
+		int id = this->nextLuaFunctionId++;
+		lua_pushvalue(L, index);
+		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		this->luaFunctions.emplace(id, LuaFunctionRef{ ref, Plugin::Get()->GetPackageId(L) });
+		this->env->SetIntField(javaLuaFunction, this->luaFunctionIdField, id);
 		return javaLuaFunction;
 	} break;
-	case Lua::LuaValue::Type::NIL:
-	case Lua::LuaValue::Type::INVALID:
-		break;
+	case LUA_TUSERDATA:
+	{
+		JavaObjectHandle* handle = (JavaObjectHandle*)luaL_testudata(L, index, "JavaObject");
+		if (handle == nullptr || handle->javaId != this->id)
+			return NULL;
+		jobject object = this->GetObjectHandle(handle->handle);
+		if (object == NULL)
+			return NULL;
+		// callers release the converted values, so hand out a fresh reference
+		return this->env->NewLocalRef(object);
+	} break;
 	default:
 		break;
 	}
@@ -197,18 +499,188 @@ jobject JavaEnv::ToJavaObject(lua_State* L, Lua::LuaValue value)
 	return NULL;
 }
 
-Lua::LuaValue JavaEnv::ToLuaValue(jobject object)
+bool JavaEnv::PushLuaValue(lua_State* L, jobject object)
 {
-	JNIEnv* jenv = this->GetEnv();
-	jclass jcls = jenv->GetObjectClass(object);
+	// converts straight onto the lua stack, without building intermediate LuaValues/LuaTables
+	// a value takes up to 3 slots while it is built (handle + metatable + __gc)
+	if (!lua_checkstack(L, 3)) {
+		if (object != NULL)
+			this->env->DeleteLocalRef(object);
+		return false;
+	}
+	if (object == NULL) {
+		lua_pushnil(L);
+		return true;
+	}
+	if (this->env->IsInstanceOf(object, stringClass)) {
+		const char* chars = this->env->GetStringUTFChars((jstring)object, nullptr);
+		lua_pushstring(L, chars);
+		this->env->ReleaseStringUTFChars((jstring)object, chars);
+	}
+	else if (this->env->IsInstanceOf(object, numberClass)) {
+		if (this->env->IsInstanceOf(object, integerClass) || this->env->IsInstanceOf(object, longClass)
+			|| this->env->IsInstanceOf(object, shortClass) || this->env->IsInstanceOf(object, byteClass))
+			lua_pushinteger(L, (lua_Integer)this->env->CallLongMethod(object, longValueMethod));
+		else
+			lua_pushnumber(L, (lua_Number)this->env->CallDoubleMethod(object, doubleValueMethod));
+	}
+	else if (this->env->IsInstanceOf(object, booleanClass)) {
+		lua_pushboolean(L, this->env->CallBooleanMethod(object, booleanValueMethod));
+	}
+	else if (this->env->IsInstanceOf(object, listClass)) {
+		jint len = this->env->CallIntMethod(object, listSizeMethod);
+		lua_createtable(L, len, 0);
+		for (jint i = 0; i < len; i++) {
+			// elements that don't fit on the stack (nested too deep) are left out
+			if (this->PushLuaValue(L, this->env->CallObjectMethod(object, listGetMethod, i)))
+				lua_rawseti(L, -2, i + 1);
+		}
+	}
+	else if (this->env->IsInstanceOf(object, mapClass)) {
+		jobject keySet = this->env->CallObjectMethod(object, mapKeySetMethod);
+		jobjectArray keyArray = (jobjectArray)this->env->CallObjectMethod(keySet, setToArrayMethod);
+		jsize len = this->env->GetArrayLength(keyArray);
+		lua_createtable(L, 0, len);
+		for (jsize i = 0; i < len; i++) {
+			jobject key = this->env->GetObjectArrayElement(keyArray, i);
+			jobject value = this->env->CallObjectMethod(object, mapGetMethod, key);
+			if (!this->PushLuaValue(L, key)) {
+				this->env->DeleteLocalRef(value);
+				continue;
+			}
+			if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1))) {
+				// nil and NaN can't be table keys, lua_rawset would raise an error
+				lua_pop(L, 1);
+				this->env->DeleteLocalRef(value);
+				continue;
+			}
+			if (!this->PushLuaValue(L, value)) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_rawset(L, -3);
+		}
+		this->env->DeleteLocalRef(keyArray);
+		this->env->DeleteLocalRef(keySet);
+	}
+	else {
+		JavaObjectHandle* handle = (JavaObjectHandle*)lua_newuserdata(L, sizeof(JavaObjectHandle));
+		handle->javaId = this->id;
+		handle->handle = this->NewObjectHandle(object);
+		if (luaL_newmetatable(L, "JavaObject")) {
+			lua_pushcfunction(L, JavaObjectGC);
+			lua_setfield(L, -2, "__gc");
+		}
+		lua_setmetatable(L, -2);
+	}
+	this->env->DeleteLocalRef(object);
+	return true;
+}
 
-	jclass stringClass = jenv->FindClass("java/lang/String");
-	jclass integerClass = jenv->FindClass("java/lang/Integer");
-	jclass doubleClass = jenv->FindClass("java/lang/Double");
-	jclass booleanClass = jenv->FindClass("java/lang/Boolean");
-	jclass listClass = jenv->FindClass("java/util/List");
-	jclass mapClass = jenv->FindClass("java/util/Map");
+jbyteArray JavaEnv::ToJavaBytes(lua_State* L, int index)
+{
+	static thread_local std::vector<char> buffer;
+	buffer.clear();
+	if (!LuaPack::Encode(L, index, buffer))
+		return NULL;
+	jbyteArray bytes = this->env->NewByteArray((jsize)buffer.size());
+	this->env->SetByteArrayRegion(bytes, 0, (jsize)buffer.size(), (const jbyte*)buffer.data());
+	return bytes;
+}
+
+void JavaEnv::PushLuaBytes(lua_State* L, jbyteArray bytes)
+{
+	static thread_local std::vector<char> buffer;
+	jsize length = this->env->GetArrayLength(bytes);
+	buffer.resize((size_t)length);
+	this->env->GetByteArrayRegion(bytes, 0, length, (jbyte*)buffer.data());
+	this->env->DeleteLocalRef(bytes);
+	if (!LuaPack::Decode(L, buffer.data(), buffer.size()))
+		lua_pushnil(L);
+}
+
+size_t JavaEnv::GetParameterTypes(const char* signature, std::string_view* types, size_t maxTypes)
+{
+	std::string_view sig(signature);
+	size_t count = 0;
+	size_t pos = sig.find('(');
+	if (pos == std::string_view::npos)
+		return 0;
+	pos++;
+	while (pos < sig.length() && sig[pos] != ')' && count < maxTypes) {
+		size_t start = pos;
+		while (pos < sig.length() && sig[pos] == '[')
+			pos++;
+		if (pos < sig.length() && sig[pos] == 'L') {
+			pos = sig.find(';', pos);
+			if (pos == std::string_view::npos)
+				break;
+		}
+		pos++;
+		types[count++] = sig.substr(start, pos - start);
+	}
+	return count;
+}
 
+std::string_view JavaEnv::GetReturnType(const char* signature)
+{
+	std::string_view sig(signature);
+	size_t spos = sig.find(')');
+	if (spos == std::string_view::npos)
+		return std::string_view();
+	return sig.substr(spos + 1);
+}
+
+int JavaEnv::NewObjectHandle(jobject object)
+{
+	uint32_t index;
+	if (!this->freeObjectSlots.empty()) {
+		index = this->freeObjectSlots.back();
+		this->freeObjectSlots.pop_back();
+	}
+	else {
+		index = (uint32_t)this->objects.size();
+		if (index >= OBJECT_HANDLE_INDEX_MASK) {
+			Onset::Plugin::Get()->Log("Too many java objects referenced from lua.");
+			return 0;
+		}
+		this->objects.push_back({ NULL, 0 });
+	}
+	ObjectSlot& slot = this->objects[index];
+	slot.object = this->env->NewGlobalRef(object);
+	return (int)(((slot.generation & OBJECT_HANDLE_GENERATION_MASK) << OBJECT_HANDLE_INDEX_BITS) | (index + 1));
+}
+
+jobject JavaEnv::GetObjectHandle(int handle)
+{
+	uint32_t index = ((uint32_t)handle & OBJECT_HANDLE_INDEX_MASK) - 1;
+	uint32_t generation = ((uint32_t)handle >> OBJECT_HANDLE_INDEX_BITS) & OBJECT_HANDLE_GENERATION_MASK;
+	if (index >= this->objects.size())
+		return NULL;
+	ObjectSlot& slot = this->objects[index];
+	if ((slot.generation & OBJECT_HANDLE_GENERATION_MASK) != generation)
+		return NULL;
+	return slot.object;
+}
+
+void JavaEnv::ReleaseObjectHandle(int handle)
+{
+	jobject object = this->GetObjectHandle(handle);
+	if (object == NULL)
+		return;
+	uint32_t index = ((uint32_t)handle & OBJECT_HANDLE_INDEX_MASK) - 1;
+	ObjectSlot& slot = this->objects[index];
+	this->env->DeleteGlobalRef(slot.object);
+	slot.object = NULL;
+	slot.generation++;
+	this->freeObjectSlots.push_back(index);
+}
+
+Lua::LuaValue JavaEnv::ToLuaValue(jobject object)
+{
+	JNIEnv* jenv = this->GetEnv();
+	if (object == NULL)
+		return NULL;
 
 	if (jenv->IsInstanceOf(object, stringClass)) {
 		jstring element = (jstring)object;
@@ -217,226 +689,185 @@ Lua::LuaValue JavaEnv::ToLuaValue(jobject object)
 		Lua::LuaValue value(pchars);
 
 		jenv->ReleaseStringUTFChars(element, pchars);
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
-
+		jenv->DeleteLocalRef(object);
 		return value;
 	}
 	else if (jenv->IsInstanceOf(object, integerClass)) {
-		jmethodID intValueMethod = jenv->GetMethodID(jcls, "intValue", "()I");
-		jint result = jenv->CallIntMethod(object, intValueMethod);
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
+		jlong result = jenv->CallLongMethod(object, longValueMethod);
+		jenv->DeleteLocalRef(object);
 
-		Lua::LuaValue value(result);
+		Lua::LuaValue value((int)result);
 		return value;
 	}
 	else if (jenv->IsInstanceOf(object, doubleClass)) {
-		jmethodID doubleValueMethod = jenv->GetMethodID(jcls, "doubleValue", "()D");
 		jdouble result = jenv->CallDoubleMethod(object, doubleValueMethod);
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
+		jenv->DeleteLocalRef(object);
 
 		Lua::LuaValue value(result);
 		return value;
 	}
 	else if (jenv->IsInstanceOf(object, booleanClass)) {
-		jmethodID boolValueMethod = jenv->GetMethodID(jcls, "booleanValue", "()Z");
-		jboolean result = jenv->CallBooleanMethod(object, boolValueMethod);
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
+		jboolean result = jenv->CallBooleanMethod(object, booleanValueMethod);
+		jenv->DeleteLocalRef(object);
 
 		Lua::LuaValue value((bool)result);
 		return value;
 	}
 	else if (jenv->IsInstanceOf(object, listClass)) {
-		jmethodID sizeMethod = jenv->GetMethodID(jcls, "size", "()I");
-		jmethodID getMethod = jenv->GetMethodID(jcls, "get", "(I)Ljava/lang/Object;");
-		jint len = jenv->CallIntMethod(object, sizeMethod);
+		jint len = jenv->CallIntMethod(object, listSizeMethod);
 
 		Lua::LuaTable_t table(new Lua::LuaTable);
 		for (jint i = 0; i < len; i++) {
-			jobject arrayElement = jenv->CallObjectMethod(object, getMethod, i);
+			jobject arrayElement = jenv->CallObjectMethod(object, listGetMethod, i);
 			table->Add(i + 1, this->ToLuaValue(arrayElement));
 		}
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
+		jenv->DeleteLocalRef(object);
 
 		Lua::LuaValue value(table);
 		return value;
 	}
 	else if (jenv->IsInstanceOf(object, mapClass)) {
-		jmethodID getMethod = jenv->GetMethodID(jcls, "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
-
-		jmethodID keySetMethod = jenv->GetMethodID(jcls, "keySet", "()Ljava/util/Set;");
-		jobject keySet = jenv->CallObjectMethod(object, keySetMethod);
-		jclass keySetClass = jenv->GetObjectClass(keySet);
-		jmethodID keySetToArrayMethod = jenv->GetMethodID(keySetClass, "toArray", "()[Ljava/lang/Object;");
-		jobjectArray keyArray = (jobjectArray)jenv->CallObjectMethod(keySet, keySetToArrayMethod);
+		jobject keySet = jenv->CallObjectMethod(object, mapKeySetMethod);
+		jobjectArray keyArray = (jobjectArray)jenv->CallObjectMethod(keySet, setToArrayMethod);
 		int arraySize = jenv->GetArrayLength(keyArray);
 
 		Lua::LuaTable_t table(new Lua::LuaTable);
 		for (int i = 0; i < arraySize; i++)
 		{
 			jobject key = jenv->GetObjectArrayElement(keyArray, i);
-			jobject value = jenv->CallObjectMethod(object, getMethod, key);
+			jobject value = jenv->CallObjectMethod(object, mapGetMethod, key);
 
 			table->Add(this->ToLuaValue(key), this->ToLuaValue(value));
 		}
-		jenv->DeleteGlobalRef(object);
-		jenv->DeleteGlobalRef(jcls);
-		jenv->DeleteGlobalRef(keySet);
-		jenv->DeleteGlobalRef(keySetClass);
-		jenv->DeleteGlobalRef(keyArray);
-
-		jenv->DeleteGlobalRef(stringClass);
-		jenv->DeleteGlobalRef(integerClass);
-		jenv->DeleteGlobalRef(doubleClass);
-		jenv->DeleteGlobalRef(booleanClass);
-		jenv->DeleteGlobalRef(listClass);
-		jenv->DeleteGlobalRef(mapClass);
+		jenv->DeleteLocalRef(object);
+		jenv->DeleteLocalRef(keySet);
+		jenv->DeleteLocalRef(keyArray);
 
 		Lua::LuaValue value(table);
 		return value;
 	}
 
-	jenv->DeleteGlobalRef(jcls);
-	jenv->DeleteGlobalRef(stringClass);
-	jenv->DeleteGlobalRef(integerClass);
-	jenv->DeleteGlobalRef(doubleClass);
-	jenv->DeleteGlobalRef(booleanClass);
-	jenv->DeleteGlobalRef(listClass);
-	jenv->DeleteGlobalRef(mapClass);
-
+	jenv->DeleteLocalRef(object);
 	return NULL;
 }
 
-jobject JavaEnv::CallStatic(std::string className, std::string methodName, std::string signature, jobject* params, size_t paramsLength) {
-	size_t spos = signature.find(")");
-	std::string returnSignature = signature.substr(spos + 1, signature.length() - spos);
-	jclass clazz = this->env->FindClass(className.c_str());
-	if (clazz == nullptr) return NULL;
-	jmethodID methodID = this->env->GetStaticMethodID(clazz, methodName.c_str(), signature.c_str());
-	if (methodID == nullptr) return NULL;
+jobject JavaEnv::CallStatic(const char* className, const char* methodName, const char* signature, jobject* params, size_t paramsLength) {
+	jclass clazz = this->FindClass(className);
+	jmethodID methodID = nullptr;
+	if (clazz != nullptr) {
+		this->EnterContext();
+		methodID = this->env->GetStaticMethodID(clazz, methodName, signature);
+		if (methodID == nullptr)
+			this->env->ExceptionClear();
+	}
 	jobject returnValue = NULL;
-	if (!returnSignature.compare("V")) {
-		switch (paramsLength) {
-		case 0:
-			this->env->CallStaticVoidMethod(clazz, methodID);
-			break;
-		case 1:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0]);
-			break;
-		case 2:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1]);
-			break;
-		case 3:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2]);
-			break;
-		case 4:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3]);
-			break;
-		case 5:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4]);
-			break;
-		case 6:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5]);
-			break;
-		case 7:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6]);
-			break;
-		case 8:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7]);
-			break;
-		case 9:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8]);
-			break;
-		case 10:
-			this->env->CallStaticVoidMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8], params[9]);
-			break;
-		default:
-			Onset::Plugin::Get()->Log("Too many parameters for CallJavaStaticMethod, 10 max.");
-			break;
+	if (methodID != nullptr) {
+		jvalue* args = ScratchArena::Get().Allocate<jvalue>(paramsLength);
+		for (size_t i = 0; i < paramsLength; i++) {
+			args[i].l = params[i];
 		}
+		if (GetReturnType(signature) == "V") {
+			this->env->CallStaticVoidMethodA(clazz, methodID, args);
+		}
+		else {
+			returnValue = this->env->CallStaticObjectMethodA(clazz, methodID, args);
+		}
+		if (this->env->ExceptionCheck()) {
+			this->env->ExceptionDescribe();
+			this->env->ExceptionClear();
+			returnValue = NULL;
+		}
+	}
+	for (size_t i = 0; i < paramsLength; i++) {
+		this->env->DeleteLocalRef(params[i]);
+	}
+	return returnValue;
+}
+
+bool JavaEnv::SetTickHandler(std::string className, std::string methodName) {
+	jclass clazz = this->FindClass(className.c_str());
+	if (clazz == nullptr) {
+		return false;
+	}
+	jmethodID methodID = this->env->GetStaticMethodID(clazz, methodName.c_str(), "(F)V");
+	if (methodID == nullptr) {
+		this->env->ExceptionClear();
+		return false;
+	}
+	if (this->tickClass != NULL)
+		this->env->DeleteGlobalRef(this->tickClass);
+	// the global ref keeps the class loaded, which keeps the cached method id valid
+	this->tickClass = (jclass)this->env->NewGlobalRef(clazz);
+	this->tickMethod = methodID;
+	return true;
+}
+
+void JavaEnv::Tick(float deltaSeconds) {
+	if (this->tickMethod == nullptr)
+		return;
+	this->EnterContext();
+	jvalue args[1];
+	args[0].f = deltaSeconds;
+	this->env->CallStaticVoidMethodA(this->tickClass, this->tickMethod, args);
+	if (this->env->ExceptionCheck()) {
+		this->env->ExceptionDescribe();
+		this->env->ExceptionClear();
+	}
+}
+
+jobject JavaEnv::CallMethod(jobject instance, const char* methodName, const char* signature, jobject* params, size_t paramsLength) {
+	jclass clazz = this->env->GetObjectClass(instance);
+	jmethodID methodID = this->env->GetMethodID(clazz, methodName, signature);
+	this->env->DeleteLocalRef(clazz);
+	jobject returnValue = NULL;
+	if (methodID == nullptr) {
+		this->env->ExceptionClear();
 	}
 	else {
-		switch (paramsLength) {
-		case 0:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID);
-			break;
-		case 1:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0]);
-			break;
-		case 2:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1]);
-			break;
-		case 3:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2]);
-			break;
-		case 4:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3]);
-			break;
-		case 5:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4]);
-			break;
-		case 6:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5]);
-			break;
-		case 7:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6]);
-			break;
-		case 8:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7]);
-			break;
-		case 9:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8]);
-			break;
-		case 10:
-			returnValue = this->env->CallStaticObjectMethod(clazz, methodID, params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8], params[9]);
-			break;
-		default:
-			Onset::Plugin::Get()->Log("Too many parameters for CallJavaStaticMethod, 10 max.");
-			break;
+		this->EnterContext();
+		jvalue* args = ScratchArena::Get().Allocate<jvalue>(paramsLength);
+		for (size_t i = 0; i < paramsLength; i++) {
+			args[i].l = params[i];
+		}
+		if (GetReturnType(signature) == "V") {
+			this->env->CallVoidMethodA(instance, methodID, args);
+		}
+		else {
+			returnValue = this->env->CallObjectMethodA(instance, methodID, args);
+		}
+		if (this->env->ExceptionCheck()) {
+			this->env->ExceptionDescribe();
+			this->env->ExceptionClear();
+			returnValue = NULL;
 		}
 	}
 	for (size_t i = 0; i < paramsLength; i++) {
-		this->env->DeleteGlobalRef(params[i]);
+		this->env->DeleteLocalRef(params[i]);
 	}
-	this->env->DeleteGlobalRef(clazz);
 	return returnValue;
+}
+
+bool JavaEnv::IsFuture(jobject object) {
+	return this->env->IsInstanceOf(object, futureClass);
+}
+
+bool JavaEnv::IsFutureDone(jobject future) {
+	jboolean done = this->env->CallBooleanMethod(future, futureIsDoneMethod);
+	if (this->env->ExceptionCheck()) {
+		// Treat a broken future as completed so the waiting coroutine gets resumed with nil.
+		this->env->ExceptionClear();
+		return true;
+	}
+	return done;
+}
+
+jobject JavaEnv::GetFutureResult(jobject future) {
+	jobject result = this->env->CallObjectMethod(future, futureGetMethod);
+	if (this->env->ExceptionCheck()) {
+		// Cancelled or exceptionally completed futures resolve to nil on the lua side.
+		this->env->ExceptionDescribe();
+		this->env->ExceptionClear();
+		return NULL;
+	}
+	return result;
 }
\ No newline at end of file
@@ -3,19 +3,59 @@
 #include <cstring>
 #include <jni.h>
 #include <map>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <string_view>
 #include <PluginSDK.h>
 
+struct JavaObjectHandle
+{
+	int javaId;
+	int handle;
+};
+
 class JavaEnv
 {
 private:
-	JavaVM* vm;
-	JNIEnv* env;
-	std::map<int, Lua::LuaValue> luaFunctions;
+	int id;
+	// HotSpot supports a single JVM per process, every JavaEnv is an isolated class loader inside it
+	static JavaVM* vm;
+	static JNIEnv* env;
+	static JavaEnv* contextEnv;
+	static bool StartVM();
+	jobject classLoader;
+	// classes resolved through the class loader, as global refs
+	std::unordered_map<std::string, jclass> classes;
+	std::string classKey;
+	jobject CreateClassLoader(const std::string& classPath);
+	void EnterContext();
+	struct LuaFunctionRef {
+		// registry reference in the package's state
+		int ref;
+		int packageId;
+	};
+	std::unordered_map<int, LuaFunctionRef> luaFunctions;
+	static void ReleaseLuaFunction(const LuaFunctionRef& function);
+	int nextLuaFunctionId;
 	jclass luaFunctionClass;
+	jmethodID luaFunctionInit;
+	jfieldID luaFunctionIdField;
+	jclass tickClass;
+	jmethodID tickMethod;
+
+	// slab of global refs to java objects held by lua, handles carry a generation to detect stale use
+	struct ObjectSlot {
+		jobject object;
+		uint32_t generation;
+	};
+	std::vector<ObjectSlot> objects;
+	std::vector<uint32_t> freeObjectSlots;
 public:
-	JavaEnv(std::string classPath);
-	void Destroy() {
-		this->vm->DestroyJavaVM();
+	JavaEnv(int id, std::string classPath);
+	void Destroy();
+	bool IsValid() {
+		return this->classLoader != NULL;
 	}
 	JavaVM* GetVM() {
 		return this->vm;
@@ -23,9 +63,36 @@ public:
 	JNIEnv* GetEnv() {
 		return this->env;
 	}
+	int GetId() {
+		return this->id;
+	}
+	jobject GetClassLoader() {
+		return this->classLoader;
+	}
+	jclass GetLuaFunctionClass() {
+		return this->luaFunctionClass;
+	}
+	// the returned class is owned by the env and must not be deleted
+	jclass FindClass(const char* className);
 	Lua::LuaValue ToLuaValue(jobject object);
-	jobject ToJavaObject(lua_State* L, Lua::LuaValue value);
+	jobject ToJavaObject(lua_State* L, int index, int depth = 0);
+	// pushes exactly one value, or nothing and returns false when the lua stack can't grow
+	bool PushLuaValue(lua_State* L, jobject object);
+	jbyteArray ToJavaBytes(lua_State* L, int index);
+	void PushLuaBytes(lua_State* L, jbyteArray bytes);
+	static size_t GetParameterTypes(const char* signature, std::string_view* types, size_t maxTypes);
+	static std::string_view GetReturnType(const char* signature);
+	int NewObjectHandle(jobject object);
+	jobject GetObjectHandle(int handle);
+	void ReleaseObjectHandle(int handle);
 	jobjectArray LuaFunctionCall(jobject instance, jobjectArray args);
 	void LuaFunctionClose(jobject instance);
-	jobject CallStatic(std::string className, std::string methodName, std::string signature, jobject* params, size_t paramsLength);
+	void ReleasePackage(int packageId);
+	jobject CallStatic(const char* className, const char* methodName, const char* signature, jobject* params, size_t paramsLength);
+	bool SetTickHandler(std::string className, std::string methodName);
+	void Tick(float deltaSeconds);
+	jobject CallMethod(jobject instance, const char* methodName, const char* signature, jobject* params, size_t paramsLength);
+	bool IsFuture(jobject object);
+	bool IsFutureDone(jobject future);
+	jobject GetFutureResult(jobject future);
 };
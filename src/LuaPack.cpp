@@ -0,0 +1,353 @@
+#include "LuaPack.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace LuaPack
+{
+	static const int MAX_DEPTH = 64;
+
+	static void WriteByte(std::vector<char>& buffer, uint8_t value)
+	{
+		buffer.push_back((char)value);
+	}
+
+	static void WriteBigEndian(std::vector<char>& buffer, uint64_t value, int bytes)
+	{
+		for (int i = bytes - 1; i >= 0; i--)
+			buffer.push_back((char)((value >> (i * 8)) & 0xFF));
+	}
+
+	static void WriteHeader(std::vector<char>& buffer, size_t length, uint8_t fixType, size_t fixMax, uint8_t type16, uint8_t type32)
+	{
+		if (length <= fixMax) {
+			WriteByte(buffer, (uint8_t)(fixType | length));
+		}
+		else if (length <= 0xFFFF) {
+			WriteByte(buffer, type16);
+			WriteBigEndian(buffer, length, 2);
+		}
+		else {
+			WriteByte(buffer, type32);
+			WriteBigEndian(buffer, length, 4);
+		}
+	}
+
+	static void WriteInteger(std::vector<char>& buffer, int64_t value)
+	{
+		if (value >= 0 && value <= 0x7F) {
+			WriteByte(buffer, (uint8_t)value);
+		}
+		else if (value < 0 && value >= -32) {
+			WriteByte(buffer, (uint8_t)(int8_t)value);
+		}
+		else if (value >= INT8_MIN && value <= INT8_MAX) {
+			WriteByte(buffer, 0xD0);
+			WriteBigEndian(buffer, (uint64_t)value, 1);
+		}
+		else if (value >= INT16_MIN && value <= INT16_MAX) {
+			WriteByte(buffer, 0xD1);
+			WriteBigEndian(buffer, (uint64_t)value, 2);
+		}
+		else if (value >= INT32_MIN && value <= INT32_MAX) {
+			WriteByte(buffer, 0xD2);
+			WriteBigEndian(buffer, (uint64_t)value, 4);
+		}
+		else {
+			WriteByte(buffer, 0xD3);
+			WriteBigEndian(buffer, (uint64_t)value, 8);
+		}
+	}
+
+	static bool EncodeValue(lua_State* L, int index, std::vector<char>& buffer, int depth)
+	{
+		index = lua_absindex(L, index);
+		switch (lua_type(L, index))
+		{
+		case LUA_TBOOLEAN:
+			WriteByte(buffer, lua_toboolean(L, index) ? 0xC3 : 0xC2);
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, index)) {
+				WriteInteger(buffer, (int64_t)lua_tointeger(L, index));
+			}
+			else {
+				double number = (double)lua_tonumber(L, index);
+				uint64_t bits;
+				std::memcpy(&bits, &number, sizeof(bits));
+				WriteByte(buffer, 0xCB);
+				WriteBigEndian(buffer, bits, 8);
+			}
+			break;
+		case LUA_TSTRING:
+		{
+			size_t length;
+			const char* str = lua_tolstring(L, index, &length);
+			if (length <= 31) {
+				WriteByte(buffer, (uint8_t)(0xA0 | length));
+			}
+			else if (length <= 0xFF) {
+				WriteByte(buffer, 0xD9);
+				WriteBigEndian(buffer, length, 1);
+			}
+			else {
+				WriteHeader(buffer, length, 0xA0, 0, 0xDA, 0xDB);
+			}
+			buffer.insert(buffer.end(), str, str + length);
+		} break;
+		case LUA_TTABLE:
+		{
+			if (depth >= MAX_DEPTH || !lua_checkstack(L, 3))
+				return false;
+			// sequences 1..n become arrays, everything else a map
+			size_t length = lua_rawlen(L, index);
+			size_t count = 0;
+			bool isArray = true;
+			lua_pushnil(L);
+			while (lua_next(L, index) != 0) {
+				if (isArray) {
+					if (!lua_isinteger(L, -2)) {
+						isArray = false;
+					}
+					else {
+						lua_Integer key = lua_tointeger(L, -2);
+						isArray = key >= 1 && (size_t)key <= length;
+					}
+				}
+				count++;
+				lua_pop(L, 1);
+			}
+			if (isArray && count == length && length > 0) {
+				WriteHeader(buffer, length, 0x90, 15, 0xDC, 0xDD);
+				for (size_t i = 1; i <= length; i++) {
+					lua_rawgeti(L, index, (lua_Integer)i);
+					bool ok = EncodeValue(L, -1, buffer, depth + 1);
+					lua_pop(L, 1);
+					if (!ok)
+						return false;
+				}
+			}
+			else {
+				WriteHeader(buffer, count, 0x80, 15, 0xDE, 0xDF);
+				lua_pushnil(L);
+				while (lua_next(L, index) != 0) {
+					if (!EncodeValue(L, -2, buffer, depth + 1) || !EncodeValue(L, -1, buffer, depth + 1)) {
+						lua_pop(L, 2);
+						return false;
+					}
+					lua_pop(L, 1);
+				}
+			}
+		} break;
+		default:
+			WriteByte(buffer, 0xC0);
+			break;
+		}
+		return true;
+	}
+
+	bool Encode(lua_State* L, int index, std::vector<char>& buffer)
+	{
+		return EncodeValue(L, index, buffer, 0);
+	}
+
+	struct Reader
+	{
+		const uint8_t* pos;
+		const uint8_t* end;
+
+		bool Has(size_t bytes) const
+		{
+			return (size_t)(this->end - this->pos) >= bytes;
+		}
+
+		bool Read(uint64_t& value, int bytes)
+		{
+			if (!this->Has((size_t)bytes))
+				return false;
+			value = 0;
+			for (int i = 0; i < bytes; i++)
+				value = (value << 8) | *this->pos++;
+			return true;
+		}
+	};
+
+	static bool DecodeValue(lua_State* L, Reader& reader, int depth);
+
+	static bool DecodeString(lua_State* L, Reader& reader, size_t length)
+	{
+		if (!reader.Has(length))
+			return false;
+		lua_pushlstring(L, (const char*)reader.pos, length);
+		reader.pos += length;
+		return true;
+	}
+
+	static bool DecodeSigned(lua_State* L, Reader& reader, int bytes)
+	{
+		uint64_t raw;
+		if (!reader.Read(raw, bytes))
+			return false;
+		int shift = 64 - bytes * 8;
+		// sign extend from the encoded width
+		int64_t value = shift > 0 ? (int64_t)(raw << shift) >> shift : (int64_t)raw;
+		lua_pushinteger(L, (lua_Integer)value);
+		return true;
+	}
+
+	static bool DecodeUnsigned(lua_State* L, Reader& reader, int bytes)
+	{
+		uint64_t value;
+		if (!reader.Read(value, bytes))
+			return false;
+		if (value > (uint64_t)INT64_MAX)
+			lua_pushnumber(L, (lua_Number)value);
+		else
+			lua_pushinteger(L, (lua_Integer)value);
+		return true;
+	}
+
+	static bool DecodeArray(lua_State* L, Reader& reader, size_t length, int depth)
+	{
+		if (depth >= MAX_DEPTH || !reader.Has(length) || !lua_checkstack(L, 2))
+			return false;
+		lua_createtable(L, (int)length, 0);
+		for (size_t i = 1; i <= length; i++) {
+			if (!DecodeValue(L, reader, depth + 1)) {
+				lua_pop(L, 1);
+				return false;
+			}
+			lua_rawseti(L, -2, (lua_Integer)i);
+		}
+		return true;
+	}
+
+	static bool DecodeMap(lua_State* L, Reader& reader, size_t length, int depth)
+	{
+		if (depth >= MAX_DEPTH || !reader.Has(length * 2) || !lua_checkstack(L, 3))
+			return false;
+		lua_createtable(L, 0, (int)length);
+		for (size_t i = 0; i < length; i++) {
+			if (!DecodeValue(L, reader, depth + 1)) {
+				lua_pop(L, 1);
+				return false;
+			}
+			if (!DecodeValue(L, reader, depth + 1)) {
+				lua_pop(L, 2);
+				return false;
+			}
+			if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2))) {
+				// nil and NaN can't be table keys
+				lua_pop(L, 2);
+				continue;
+			}
+			lua_rawset(L, -3);
+		}
+		return true;
+	}
+
+	static bool DecodeValue(lua_State* L, Reader& reader, int depth)
+	{
+		uint64_t type;
+		if (!reader.Read(type, 1))
+			return false;
+		if (type <= 0x7F) {
+			lua_pushinteger(L, (lua_Integer)type);
+			return true;
+		}
+		if (type >= 0xE0) {
+			lua_pushinteger(L, (lua_Integer)(int8_t)type);
+			return true;
+		}
+		if ((type & 0xF0) == 0x80)
+			return DecodeMap(L, reader, (size_t)(type & 0x0F), depth);
+		if ((type & 0xF0) == 0x90)
+			return DecodeArray(L, reader, (size_t)(type & 0x0F), depth);
+		if ((type & 0xE0) == 0xA0)
+			return DecodeString(L, reader, (size_t)(type & 0x1F));
+
+		uint64_t length;
+		switch (type)
+		{
+		case 0xC0:
+			lua_pushnil(L);
+			return true;
+		case 0xC2:
+			lua_pushboolean(L, 0);
+			return true;
+		case 0xC3:
+			lua_pushboolean(L, 1);
+			return true;
+		case 0xC4:
+		case 0xD9:
+			return reader.Read(length, 1) && DecodeString(L, reader, (size_t)length);
+		case 0xC5:
+		case 0xDA:
+			return reader.Read(length, 2) && DecodeString(L, reader, (size_t)length);
+		case 0xC6:
+		case 0xDB:
+			return reader.Read(length, 4) && DecodeString(L, reader, (size_t)length);
+		case 0xCA:
+		{
+			uint64_t raw;
+			if (!reader.Read(raw, 4))
+				return false;
+			uint32_t bits = (uint32_t)raw;
+			float number;
+			std::memcpy(&number, &bits, sizeof(number));
+			lua_pushnumber(L, (lua_Number)number);
+			return true;
+		}
+		case 0xCB:
+		{
+			uint64_t bits;
+			if (!reader.Read(bits, 8))
+				return false;
+			double number;
+			std::memcpy(&number, &bits, sizeof(number));
+			lua_pushnumber(L, (lua_Number)number);
+			return true;
+		}
+		case 0xCC:
+			return DecodeUnsigned(L, reader, 1);
+		case 0xCD:
+			return DecodeUnsigned(L, reader, 2);
+		case 0xCE:
+			return DecodeUnsigned(L, reader, 4);
+		case 0xCF:
+			return DecodeUnsigned(L, reader, 8);
+		case 0xD0:
+			return DecodeSigned(L, reader, 1);
+		case 0xD1:
+			return DecodeSigned(L, reader, 2);
+		case 0xD2:
+			return DecodeSigned(L, reader, 4);
+		case 0xD3:
+			return DecodeSigned(L, reader, 8);
+		case 0xDC:
+			return reader.Read(length, 2) && DecodeArray(L, reader, (size_t)length, depth);
+		case 0xDD:
+			return reader.Read(length, 4) && DecodeArray(L, reader, (size_t)length, depth);
+		case 0xDE:
+			return reader.Read(length, 2) && DecodeMap(L, reader, (size_t)length, depth);
+		case 0xDF:
+			return reader.Read(length, 4) && DecodeMap(L, reader, (size_t)length, depth);
+		default:
+			// ext types are not supported
+			return false;
+		}
+	}
+
+	bool Decode(lua_State* L, const char* data, size_t length)
+	{
+		Reader reader;
+		reader.pos = (const uint8_t*)data;
+		reader.end = reader.pos + length;
+		int top = lua_gettop(L);
+		if (!DecodeValue(L, reader, 0) || reader.pos != reader.end) {
+			lua_settop(L, top);
+			return false;
+		}
+		return true;
+	}
+}
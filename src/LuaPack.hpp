@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+#include <PluginSDK.h>
+
+// Compact MessagePack encoding of lua values, used to move large nested tables
+// across the bridge as a single byte[] instead of nested HashMaps.
+// The java side counterpart is lua.LuaPack in OnsetJavaPluginSupport.
+namespace LuaPack
+{
+	// Appends the value at the given stack index to buffer.
+	// Functions, userdata and threads are encoded as nil. Returns false if the value is nested too deep.
+	bool Encode(lua_State* L, int index, std::vector<char>& buffer);
+	// Pushes the decoded value onto the stack. Returns false and pushes nothing if the data is malformed.
+	bool Decode(lua_State* L, const char* data, size_t length);
+}
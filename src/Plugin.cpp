@@ -11,6 +11,8 @@ namespace fs = std::filesystem;
 #endif
 
 #include "Plugin.hpp"
+#include "Trace.hpp"
+#include "ScratchArena.hpp"
 
 #ifdef LUA_DEFINE
 # undef LUA_DEFINE
@@ -21,67 +23,338 @@ namespace fs = std::filesystem;
 typedef UINT(CALLBACK* JVMDLLFunction)(JavaVM**, void**, JavaVMInitArgs*);
 #endif
 
-Lua::LuaArgs_t CallLuaFunction(lua_State* ScriptVM, const char* LuaFunctionName, Lua::LuaArgs_t* Arguments) {
-	Lua::LuaArgs_t ReturnValues;
-	int ArgCount = lua_gettop(ScriptVM);
-	lua_getglobal(ScriptVM, LuaFunctionName);
-	int argc = 0;
-	if (Arguments) {
-		for (auto const& e : *Arguments) {
-			Lua::PushValueToLua(e, ScriptVM);
-			argc++;
-		}
-	}
-	int Status = lua_pcall(ScriptVM, argc, LUA_MULTRET, 0);
-	ArgCount = lua_gettop(ScriptVM) - ArgCount;
-	if (Status == LUA_OK) {
-		Lua::ParseArguments(ScriptVM, ReturnValues);
-		lua_pop(ScriptVM, ArgCount);
-	}
-	return ReturnValues;
-}
-
 int Plugin::CreateJava(std::string classPath)
 {
-	int id = 0;
-	while (this->jenvs[id] != nullptr)
-		id++;
-	this->jenvs[id] = new JavaEnv(classPath);
-	return id + 1;
+	// ids are never reused, so handles and callbacks of a destroyed env can't hit a new one
+	int id = (int)this->jenvs.size() + 1;
+	JavaEnv* env = new JavaEnv(id, classPath);
+	if (!env->IsValid()) {
+		delete env;
+		return -1;
+	}
+	this->jenvs.push_back(env);
+	return id;
 }
 
 void Plugin::DestroyJava(int id)
 {
-	this->jenvs[id - 1]->Destroy();
+	JavaEnv* env = this->GetJavaEnv(id);
+	if (!env) return;
+	JNIEnv* jenv = env->GetEnv();
+	for (auto& package : this->packages) {
+		for (size_t i = 0; i < package.adapters.size();) {
+			if (package.adapters[i].javaId == id) {
+				jenv->UnregisterNatives(package.adapters[i].clazz);
+				jenv->DeleteGlobalRef(package.adapters[i].clazz);
+				package.adapters.erase(package.adapters.begin() + i);
+			}
+			else {
+				i++;
+			}
+		}
+	}
+	for (auto& call : this->asyncCalls) {
+		if (call.javaId == id) {
+			// the coroutine gets resumed with nil on the next tick
+			jenv->DeleteGlobalRef(call.future);
+			call.future = NULL;
+		}
+	}
+	// a lua handler entered from this env may be calling us, so it is only freed on the next tick
 	this->jenvs[id - 1] = nullptr;
+	this->destroyedJenvs.push_back(env);
 }
 
 JavaEnv* Plugin::GetJavaEnv(int id)
 {
+	if (id < 1 || id > (int)this->jenvs.size())
+		return nullptr;
 	return this->jenvs[id - 1];
 }
 
-JavaEnv* Plugin::FindJavaEnv(JNIEnv* jenv) {
-	int i;
-	for (i = 0; i < 30; i++) {
-		if (this->jenvs[i] != nullptr) {
-			if (this->jenvs[i]->GetEnv() == jenv) {
-				return this->jenvs[i];
+JavaEnv* Plugin::FindJavaEnv(JNIEnv* jenv, jclass clazz) {
+	// natives are only registered on LuaFunction and linked adapters, the class they are called on identifies the env
+	for (JavaEnv* env : this->jenvs) {
+		// calls from other threads aren't supported, they would use the main thread's JNIEnv
+		if (env != nullptr && env->GetEnv() == jenv && jenv->IsSameObject(clazz, env->GetLuaFunctionClass()))
+			return env;
+	}
+	for (auto const& package : this->packages) {
+		for (auto const& adapter : package.adapters) {
+			if (jenv->IsSameObject(clazz, adapter.clazz)) {
+				JavaEnv* env = this->GetJavaEnv(adapter.javaId);
+				return env != nullptr && env->GetEnv() == jenv ? env : nullptr;
 			}
 		}
 	}
 	return nullptr;
 }
 
+lua_State* Plugin::GetMainState(lua_State* L)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	lua_State* mainState = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	return mainState;
+}
+
+static int AsyncContinuation(lua_State* L, int status, lua_KContext ctx)
+{
+	(void)status;
+	Plugin::Get()->FinishAsyncCall((int)ctx);
+	// the future's result was pushed by ResumeAsyncCalls and becomes the return value of the call
+	return lua_gettop(L);
+}
+
+int Plugin::YieldForFuture(lua_State* L, int javaId, jobject future)
+{
+	JNIEnv* jenv = this->GetJavaEnv(javaId)->GetEnv();
+	AsyncCall call;
+	call.token = this->nextAsyncToken++;
+	call.javaId = javaId;
+	call.future = jenv->NewGlobalRef(future);
+	jenv->DeleteLocalRef(future);
+	call.thread = L;
+	call.owner = GetMainState(L);
+	// keep the coroutine alive while it waits for the future
+	lua_pushthread(L);
+	call.threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	this->asyncCalls.push_back(call);
+	return lua_yieldk(L, 0, (lua_KContext)call.token, AsyncContinuation);
+}
+
+void Plugin::DropAsyncCall(size_t index)
+{
+	AsyncCall call = this->asyncCalls[index];
+	this->asyncCalls[index] = this->asyncCalls.back();
+	this->asyncCalls.pop_back();
+	JavaEnv* env = this->GetJavaEnv(call.javaId);
+	if (env != nullptr)
+		env->GetEnv()->DeleteGlobalRef(call.future);
+	luaL_unref(call.owner, LUA_REGISTRYINDEX, call.threadRef);
+}
+
+void Plugin::FinishAsyncCall(int token)
+{
+	if (token == this->resumingToken)
+		return;
+	// resumed by lua code (coroutine.resume) while waiting, the call is abandoned and its result discarded
+	for (size_t i = 0; i < this->asyncCalls.size(); i++) {
+		if (this->asyncCalls[i].token == token) {
+			this->DropAsyncCall(i);
+			break;
+		}
+	}
+}
+
+void Plugin::ResumeAsyncCalls()
+{
+	size_t i = 0;
+	while (i < this->asyncCalls.size()) {
+		AsyncCall call = this->asyncCalls[i];
+		if (lua_status(call.thread) != LUA_YIELD) {
+			// running or dead, it was taken over by a lua scheduler
+			this->DropAsyncCall(i);
+			continue;
+		}
+		JavaEnv* env = this->GetJavaEnv(call.javaId);
+		if (env != nullptr && !env->IsFutureDone(call.future)) {
+			i++;
+			continue;
+		}
+		this->asyncCalls[i] = this->asyncCalls.back();
+		this->asyncCalls.pop_back();
+
+		int resultCount = 0;
+		if (env != nullptr) {
+			jobject result = env->GetFutureResult(call.future);
+			env->GetEnv()->DeleteGlobalRef(call.future);
+			if (env->PushLuaValue(call.thread, result))
+				resultCount = 1;
+		}
+		else if (lua_checkstack(call.thread, 1)) {
+			// the JVM was destroyed while the coroutine was waiting
+			lua_pushnil(call.thread);
+			resultCount = 1;
+		}
+
+		this->resumingToken = call.token;
+		int status = lua_resume(call.thread, nullptr, resultCount);
+		this->resumingToken = 0;
+		if (status != LUA_OK && status != LUA_YIELD) {
+			Onset::Plugin::Get()->Log("Failed to resume coroutine: %s", lua_tostring(call.thread, -1));
+			lua_pop(call.thread, 1);
+		}
+		luaL_unref(call.owner, LUA_REGISTRYINDEX, call.threadRef);
+	}
+}
+
+void Plugin::Tick(float deltaSeconds)
+{
+	for (JavaEnv* env : this->destroyedJenvs) {
+		env->Destroy();
+		delete env;
+	}
+	this->destroyedJenvs.clear();
+	// handlers may create envs while ticking, which can grow the vector
+	for (size_t i = 0; i < this->jenvs.size(); i++) {
+		if (this->jenvs[i] != nullptr)
+			this->jenvs[i]->Tick(deltaSeconds);
+	}
+	this->ResumeAsyncCalls();
+}
+
+void Plugin::CancelAsyncCalls(lua_State* owner)
+{
+	size_t i = 0;
+	while (i < this->asyncCalls.size()) {
+		if (this->asyncCalls[i].owner != owner) {
+			i++;
+			continue;
+		}
+		this->DropAsyncCall(i);
+	}
+}
+
+int Plugin::AddPackage(std::string name, lua_State* state)
+{
+	if (this->GetPackageId(name) != 0)
+		this->RemovePackage(name);
+	int packageId;
+	if (!this->freePackageIds.empty()) {
+		packageId = this->freePackageIds.back();
+		this->freePackageIds.pop_back();
+	}
+	else {
+		this->packages.emplace_back();
+		packageId = (int)this->packages.size();
+	}
+	Package& package = this->packages[packageId - 1];
+	package.name = name;
+	package.state = state;
+	this->packageIds[name] = packageId;
+	this->statePackageIds[state] = packageId;
+	this->TrackEvents(package);
+	return packageId;
+}
+
+void Plugin::RemovePackage(std::string name)
+{
+	int packageId = this->GetPackageId(name);
+	if (packageId == 0) return;
+	Package& package = this->packages[packageId - 1];
+	this->CancelAsyncCalls(package.state);
+	for (JavaEnv* env : this->jenvs) {
+		if (env != nullptr)
+			env->ReleasePackage(packageId);
+	}
+	// envs waiting for the next tick still hold functions of this package, the state may be closed before they are freed
+	for (JavaEnv* env : this->destroyedJenvs)
+		env->ReleasePackage(packageId);
+	for (auto const& adapter : package.adapters)
+		this->UnlinkJavaAdapter(packageId, adapter);
+	package.adapters.clear();
+	for (auto const& listeners : package.eventListeners)
+		this->eventListenerCounts[listeners.first] -= listeners.second;
+	package.eventListeners.clear();
+	if (!package.eventsHooked)
+		this->untrackedPackages--;
+	this->statePackageIds.erase(package.state);
+	this->packageIds.erase(package.name);
+	package.name.clear();
+	package.state = nullptr;
+	this->freePackageIds.push_back(packageId);
+}
+
+static int TrackedAddEvent(lua_State* L)
+{
+	int argc = lua_gettop(L);
+	if (lua_type(L, 1) != LUA_TSTRING) {
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_insert(L, 1);
+		lua_call(L, argc, LUA_MULTRET);
+		return lua_gettop(L);
+	}
+	// keep a copy of the event name below the call, the listener only counts once AddEvent didn't raise
+	lua_pushvalue(L, 1);
+	lua_insert(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 2);
+	lua_call(L, argc, LUA_MULTRET);
+	Plugin::Get()->AddEventListener(L, lua_tostring(L, 1));
+	lua_remove(L, 1);
+	return lua_gettop(L);
+}
+
+void Plugin::TrackEvents(Package& package)
+{
+	// wrap the package's AddEvent so we know which events have handlers at all
+	lua_getglobal(package.state, "AddEvent");
+	if (!lua_isfunction(package.state, -1)) {
+		lua_pop(package.state, 1);
+		package.eventsHooked = false;
+		this->untrackedPackages++;
+		return;
+	}
+	lua_pushcclosure(package.state, TrackedAddEvent, 1);
+	lua_setglobal(package.state, "AddEvent");
+	package.eventsHooked = true;
+}
+
+int Plugin::GetEventId(const std::string& name)
+{
+	auto it = this->eventIds.find(name);
+	if (it != this->eventIds.end())
+		return it->second;
+	int eventId = (int)this->eventListenerCounts.size();
+	this->eventIds.emplace(name, eventId);
+	this->eventListenerCounts.push_back(0);
+	return eventId;
+}
+
+void Plugin::AddEventListener(lua_State* L, const std::string& name)
+{
+	int packageId = this->GetPackageId(L);
+	if (packageId == 0) return;
+	int eventId = this->GetEventId(name);
+	this->packages[packageId - 1].eventListeners[eventId]++;
+	this->eventListenerCounts[eventId]++;
+}
+
+void Plugin::UnlinkJavaAdapter(int packageId, JavaAdapter adapter)
+{
+	JavaEnv* env = this->GetJavaEnv(adapter.javaId);
+	if (env == nullptr) return;
+	JNIEnv* jenv = env->GetEnv();
+	bool linkedElsewhere = false;
+	for (size_t i = 0; i < this->packages.size() && !linkedElsewhere; i++) {
+		if ((int)i + 1 == packageId) continue;
+		for (auto const& other : this->packages[i].adapters) {
+			if (other.javaId == adapter.javaId && jenv->IsSameObject(other.clazz, adapter.clazz)) {
+				linkedElsewhere = true;
+				break;
+			}
+		}
+	}
+	if (!linkedElsewhere)
+		jenv->UnregisterNatives(adapter.clazz);
+	jenv->DeleteGlobalRef(adapter.clazz);
+}
+
 void CallEvent(JNIEnv* jenv, jclass jcl, jstring event, jobjectArray argsList) {
-	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv);
+	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv, jcl);
 	if (env == nullptr) {
 		return;
 	}
-	(void)jcl;
 
 	const char* eventStr = jenv->GetStringUTFChars(event, nullptr);
-	Lua::LuaArgs_t args;
+	if (!Plugin::Get()->HasEventListeners(eventStr)) {
+		jenv->ReleaseStringUTFChars(event, eventStr);
+		return;
+	}
+	Trace::Scope trace("java->lua", "CallEvent", eventStr);
+	ScratchArena::Scope scratch;
+	Lua::LuaArgs_t& args = ScratchArena::Get().AcquireArgs();
 
 	int argsCount = jenv->GetArrayLength(argsList);
 
@@ -90,45 +363,113 @@ void CallEvent(JNIEnv* jenv, jclass jcl, jstring event, jobjectArray argsList) {
 		args.push_back(env->ToLuaValue(arrayElement));
 	}
 
+	trace.BeginExecution();
 	Onset::Plugin::Get()->CallEvent(eventStr, &args);
+	trace.EndExecution();
 
 	jenv->ReleaseStringUTFChars(event, eventStr);
 }
 
 jobjectArray CallGlobal(JNIEnv* jenv, jclass jcl, jstring packageName, jstring functionName, jobjectArray args) {
-	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv);
+	JavaEnv* env = Plugin::Get()->FindJavaEnv(jenv, jcl);
 	if (env == nullptr) {
 		return NULL;
 	}
 
-	(void)jcl;
-
 	const char* packageNameStr = jenv->GetStringUTFChars(packageName, nullptr);
+	lua_State* L = Plugin::Get()->GetPackageState(packageNameStr);
+	if (L == nullptr) {
+		jenv->ReleaseStringUTFChars(packageName, packageNameStr);
+		return NULL;
+	}
 	const char* functionNameStr = jenv->GetStringUTFChars(functionName, nullptr);
+	Trace::Scope trace("java->lua", packageNameStr, functionNameStr);
+	ScratchArena::Scope scratch;
+	int top = lua_gettop(L);
 	int argsLength = jenv->GetArrayLength(args);
-	Lua::LuaArgs_t luaArgs;
-	for (jsize i = 0; i < argsLength; i++) {
-		luaArgs.push_back(env->ToLuaValue(jenv->GetObjectArrayElement(args, i)));
+	bool pushed = lua_checkstack(L, argsLength + 1);
+	if (pushed) {
+		lua_getglobal(L, functionNameStr);
+		for (jsize i = 0; i < argsLength && pushed; i++) {
+			pushed = env->PushLuaValue(L, jenv->GetObjectArrayElement(args, i));
+		}
+	}
+	if (!pushed) {
+		lua_settop(L, top);
+		jenv->ReleaseStringUTFChars(packageName, packageNameStr);
+		jenv->ReleaseStringUTFChars(functionName, functionNameStr);
+		return NULL;
 	}
 
-	auto luaReturns = CallLuaFunction(Plugin::Get()->GetPackageState(packageNameStr), functionNameStr, &luaArgs);
-	size_t returnsLength = luaReturns.size();
+	trace.BeginExecution();
+	int status = lua_pcall(L, argsLength, LUA_MULTRET, 0);
+	trace.EndExecution();
+	// only the returns are converted, anything below top belongs to an outer call
+	int returnsLength = status == LUA_OK ? lua_gettop(L) - top : 0;
 	jclass objectCls = jenv->FindClass("Ljava/lang/Object;");
 	jobjectArray returns = jenv->NewObjectArray((jsize)returnsLength, objectCls, NULL);
-	for (jsize i = 0; i < (int)returnsLength; i++) {
-		jobject o = env->ToJavaObject(Plugin::Get()->GetPackageState(packageNameStr), luaReturns[i]);
+	for (jsize i = 0; i < returnsLength; i++) {
+		jobject o = env->ToJavaObject(L, top + i + 1);
 		jenv->SetObjectArrayElement(returns, i, o);
-		jenv->DeleteGlobalRef(o);
+		jenv->DeleteLocalRef(o);
 	}
+	jenv->DeleteLocalRef(objectCls);
+	lua_settop(L, top);
 	jenv->ReleaseStringUTFChars(packageName, packageNameStr);
 	jenv->ReleaseStringUTFChars(functionName, functionNameStr);
 	return returns;
 }
 
+jint JGetEventId(JNIEnv* jenv, jclass jcl, jstring event) {
+	(void)jcl;
+	const char* eventStr = jenv->GetStringUTFChars(event, nullptr);
+	int eventId = Plugin::Get()->GetEventId(eventStr);
+	jenv->ReleaseStringUTFChars(event, eventStr);
+	return eventId;
+}
+
+jboolean JHasEventListeners(JNIEnv* jenv, jclass jcl, jint eventId) {
+	(void)jenv;
+	(void)jcl;
+	return Plugin::Get()->HasEventListeners(eventId) ? JNI_TRUE : JNI_FALSE;
+}
+
+bool Plugin::LinkJavaAdapter(lua_State* L, int javaId, jclass clazz)
+{
+	int packageId = this->GetPackageId(L);
+	if (packageId == 0) return false;
+	JNIEnv* jenv = this->GetJavaEnv(javaId)->GetEnv();
+	Package& package = this->packages[packageId - 1];
+	for (auto const& adapter : package.adapters) {
+		if (adapter.javaId == javaId && jenv->IsSameObject(adapter.clazz, clazz))
+			return true;
+	}
+	JNINativeMethod methods[] = {
+		{(char*)"callEvent", (char*)"(Ljava/lang/String;[Ljava/lang/Object;)V", (void*)CallEvent },
+		{(char*)"callGlobalFunction", (char*)"(Ljava/lang/String;Ljava/lang/String;[Ljava/lang/Object;)[Ljava/lang/Object;", (void*)CallGlobal }
+	};
+	if (jenv->RegisterNatives(clazz, methods, 2) != JNI_OK) {
+		jenv->ExceptionClear();
+		return false;
+	}
+	// optional natives, adapters only have to declare the ones they use
+	JNINativeMethod optionalMethods[] = {
+		{(char*)"getEventId", (char*)"(Ljava/lang/String;)I", (void*)JGetEventId },
+		{(char*)"hasEventListeners", (char*)"(I)Z", (void*)JHasEventListeners }
+	};
+	for (auto const& method : optionalMethods) {
+		if (jenv->RegisterNatives(clazz, &method, 1) != JNI_OK)
+			jenv->ExceptionClear();
+	}
+	package.adapters.push_back({ javaId, (jclass)jenv->NewGlobalRef(clazz) });
+	return true;
+}
+
 Plugin::Plugin()
 {
-	for (int i = 0; i < 30; i++)
-		this->jenvs[i] = nullptr;
+	this->untrackedPackages = 0;
+	this->nextAsyncToken = 1;
+	this->resumingToken = 0;
 
 	LUA_DEFINE(CreateJava)
 	{
@@ -176,7 +517,7 @@ LUA_DEFINE(LinkJavaAdapter)
 	int id;
 	Lua::ParseArguments(L, id);
 	if (!Plugin::Get()->GetJavaEnv(id)) return 0;
-	JNIEnv* jenv = Plugin::Get()->GetJavaEnv(id)->GetEnv();
+	JavaEnv* env = Plugin::Get()->GetJavaEnv(id);
 	Lua::LuaArgs_t arg_list;
 	Lua::ParseArguments(L, arg_list);
 
@@ -184,63 +525,143 @@ LUA_DEFINE(LinkJavaAdapter)
 	if (arg_size < 2) return 0;
 
 	std::string className = arg_list[1].GetValue<std::string>();
-	jclass clazz = jenv->FindClass(className.c_str());
+	jclass clazz = env->FindClass(className.c_str());
 	if (clazz == nullptr) return 0;
-	JNINativeMethod methods[] = {
-		{(char*)"callEvent", (char*)"(Ljava/lang/String;[Ljava/lang/Object;)V", (void*)CallEvent },
-		{(char*)"callGlobalFunction", (char*)"(Ljava/lang/String;Ljava/lang/String;[Ljava/lang/Object;)[Ljava/lang/Object;", (void*)CallGlobal }
-	};
-	jenv->RegisterNatives(clazz, methods, 2);
+	if (!Plugin::Get()->LinkJavaAdapter(L, id, clazz)) return 0;
 	Lua::ReturnValues(L, 1);
 	return 1;
 });
 
-LUA_DEFINE(CallJavaStaticMethod)
+LUA_DEFINE(SetJavaTickHandler)
 {
 	int id;
 	Lua::ParseArguments(L, id);
-
 	if (!Plugin::Get()->GetJavaEnv(id)) return 0;
-	JavaEnv* env = Plugin::Get()->GetJavaEnv(id);
-
 	Lua::LuaArgs_t arg_list;
 	Lua::ParseArguments(L, arg_list);
 
 	int arg_size = static_cast<int>(arg_list.size());
-	if (arg_size < 4) return 0;
-	lua_pop(L, arg_size);
+	if (arg_size < 3) return 0;
 
 	std::string className = arg_list[1].GetValue<std::string>();
 	std::string methodName = arg_list[2].GetValue<std::string>();
-	std::string signature = arg_list[3].GetValue<std::string>();
-	jobject* params = new jobject[arg_size - 4];
-	for (int i = 4; i < arg_size; i++) {
-		auto const& value = arg_list[i];
-		params[i - 4] = env->ToJavaObject(L, value);
-	}
-	jobject returnValue = Plugin::Get()->GetJavaEnv(id)->CallStatic(className, methodName, signature, params, arg_size - 4);
-	delete[] params;
-	if (returnValue != NULL) {
-		Lua::LuaValue value = env->ToLuaValue(returnValue);
-		if (!(value == NULL)) {
-			switch (value.GetType())
-			{
-			case Lua::LuaValue::Type::STRING:
-				Lua::ReturnValues(L, value.GetValue<std::string>().c_str());
-				break;
-			case Lua::LuaValue::Type::INTEGER:
-				Lua::ReturnValues(L, value.GetValue<int>());
-				break;
-			case Lua::LuaValue::Type::BOOLEAN:
-				Lua::ReturnValues(L, value.GetValue<bool>());
-				break;
-			case Lua::LuaValue::Type::TABLE:
-				Lua::ReturnValues(L, value.GetValue<Lua::LuaTable_t>());
-				break;
-			default:
-				break;
-			}
+	if (!Plugin::Get()->GetJavaEnv(id)->SetTickHandler(className, methodName)) return 0;
+	Lua::ReturnValues(L, 1);
+	return 1;
+});
+
+LUA_DEFINE(SetJavaTraceEnabled)
+{
+	Lua::LuaArgs_t args;
+	Lua::ParseArguments(L, args);
+	if (args.size() < 1) return 0;
+	Trace::SetEnabled(args[0].GetValue<bool>());
+	Lua::ReturnValues(L, 1);
+	return 1;
+});
+
+LUA_DEFINE(FlushJavaTrace)
+{
+	Lua::LuaArgs_t args;
+	Lua::ParseArguments(L, args);
+	if (args.size() < 1) return 0;
+	int count = Trace::Flush(args[0].GetValue<std::string>());
+	if (count < 0) return 0;
+	Lua::ReturnValues(L, count);
+	return 1;
+});
+
+LUA_DEFINE(CallJavaStaticMethod)
+{
+	int id;
+	Lua::ParseArguments(L, id);
+
+	if (!Plugin::Get()->GetJavaEnv(id)) return 0;
+	JavaEnv* env = Plugin::Get()->GetJavaEnv(id);
+
+	jobject returnValue;
+	bool returnsBytes;
+	{
+		ScratchArena::Scope scratch;
+		int arg_size = lua_gettop(L);
+		if (arg_size < 4) return 0;
+
+		// the strings stay on the lua stack until the call returns
+		const char* className = lua_tostring(L, 2);
+		const char* methodName = lua_tostring(L, 3);
+		const char* signature = lua_tostring(L, 4);
+		if (className == nullptr || methodName == nullptr || signature == nullptr) return 0;
+		Trace::Scope trace("lua->java", className, methodName);
+		size_t paramsLength = arg_size - 4;
+		std::string_view* paramTypes = ScratchArena::Get().Allocate<std::string_view>(paramsLength);
+		size_t paramTypesLength = JavaEnv::GetParameterTypes(signature, paramTypes, paramsLength);
+		jobject* params = ScratchArena::Get().Allocate<jobject>(paramsLength);
+		for (int i = 4; i < arg_size; i++) {
+			if (i - 4 < (int)paramTypesLength && paramTypes[i - 4] == "[B" && lua_istable(L, i + 1))
+				params[i - 4] = env->ToJavaBytes(L, i + 1);
+			else
+				params[i - 4] = env->ToJavaObject(L, i + 1);
 		}
+		trace.BeginExecution();
+		returnValue = env->CallStatic(className, methodName, signature, params, paramsLength);
+		trace.EndExecution();
+		returnsBytes = JavaEnv::GetReturnType(signature) == "[B";
+		lua_pop(L, arg_size);
+	}
+	// lua_yieldk leaves this frame without unwinding, so nothing with a destructor may be alive from here on
+	if (returnValue != NULL && lua_isyieldable(L) && env->IsFuture(returnValue)) {
+		// inside a coroutine: suspend it until the future completes instead of blocking the tick
+		return Plugin::Get()->YieldForFuture(L, id, returnValue);
+	}
+	if (returnValue != NULL) {
+		if (returnsBytes)
+			env->PushLuaBytes(L, (jbyteArray)returnValue);
+		else if (!env->PushLuaValue(L, returnValue))
+			return 0;
+	}
+	else {
+		Lua::ReturnValues(L, 1);
+	}
+	return 1;
+});
+
+LUA_DEFINE(CallJavaMethod)
+{
+	JavaObjectHandle* handle = (JavaObjectHandle*)luaL_testudata(L, 1, "JavaObject");
+	if (handle == nullptr) return 0;
+	JavaEnv* env = Plugin::Get()->GetJavaEnv(handle->javaId);
+	if (!env) return 0;
+	jobject instance = env->GetObjectHandle(handle->handle);
+	if (instance == NULL) return 0;
+
+	ScratchArena::Scope scratch;
+	int arg_size = lua_gettop(L);
+	if (arg_size < 3) return 0;
+
+	const char* methodName = lua_tostring(L, 2);
+	const char* signature = lua_tostring(L, 3);
+	if (methodName == nullptr || signature == nullptr) return 0;
+	Trace::Scope trace("lua->java", "CallJavaMethod", methodName);
+	size_t paramsLength = arg_size - 3;
+	std::string_view* paramTypes = ScratchArena::Get().Allocate<std::string_view>(paramsLength);
+	size_t paramTypesLength = JavaEnv::GetParameterTypes(signature, paramTypes, paramsLength);
+	jobject* params = ScratchArena::Get().Allocate<jobject>(paramsLength);
+	for (int i = 3; i < arg_size; i++) {
+		if (i - 3 < (int)paramTypesLength && paramTypes[i - 3] == "[B" && lua_istable(L, i + 1))
+			params[i - 3] = env->ToJavaBytes(L, i + 1);
+		else
+			params[i - 3] = env->ToJavaObject(L, i + 1);
+	}
+	trace.BeginExecution();
+	jobject returnValue = env->CallMethod(instance, methodName, signature, params, paramsLength);
+	trace.EndExecution();
+	bool returnsBytes = JavaEnv::GetReturnType(signature) == "[B";
+	lua_pop(L, arg_size);
+	if (returnValue != NULL) {
+		if (returnsBytes)
+			env->PushLuaBytes(L, (jbyteArray)returnValue);
+		else if (!env->PushLuaValue(L, returnValue))
+			return 0;
 	}
 	else {
 		Lua::ReturnValues(L, 1);
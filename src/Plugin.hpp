@@ -3,6 +3,7 @@
 #include <vector>
 #include <tuple>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <jni.h>
 #include <PluginSDK.h>
@@ -15,9 +16,51 @@ class Plugin : public Singleton<Plugin>
 private:
 	Plugin();
 	~Plugin() = default;
-	JavaEnv* jenvs[30];
-	std::map<std::string, lua_State*> packageStates;
-	std::map<lua_State*, std::string> statePackages;
+	std::vector<JavaEnv*> jenvs;
+	// envs removed by DestroyJava, deleted on the next tick once nothing can be running inside them
+	std::vector<JavaEnv*> destroyedJenvs;
+
+	struct JavaAdapter {
+		int javaId;
+		jclass clazz;
+	};
+	struct Package {
+		std::string name;
+		lua_State* state;
+		std::vector<JavaAdapter> adapters;
+		std::unordered_map<int, int> eventListeners;
+		bool eventsHooked;
+	};
+	// dense package table indexed by package id - 1, slots of unloaded packages are reused
+	std::vector<Package> packages;
+	std::vector<int> freePackageIds;
+	std::unordered_map<std::string, int> packageIds;
+	std::unordered_map<lua_State*, int> statePackageIds;
+	// reused for lookups by C string, so crossings don't build a temporary std::string
+	std::string lookupKey;
+
+	// interned event names and the number of AddEvent handlers registered for each of them
+	std::unordered_map<std::string, int> eventIds;
+	std::vector<int> eventListenerCounts;
+	// packages where AddEvent could not be tracked, listener counts are unreliable while > 0
+	int untrackedPackages;
+	void TrackEvents(Package& package);
+
+	struct AsyncCall {
+		// passed as the continuation context, tells our resumes apart from ones done by lua code
+		int token;
+		int javaId;
+		jobject future;
+		lua_State* thread;
+		lua_State* owner;
+		int threadRef;
+	};
+	std::vector<AsyncCall> asyncCalls;
+	int nextAsyncToken;
+	int resumingToken;
+	void DropAsyncCall(size_t index);
+
+	void UnlinkJavaAdapter(int packageId, JavaAdapter adapter);
 
 private:
 	using FuncInfo_t = std::tuple<const char*, lua_CFunction>;
@@ -34,22 +77,69 @@ public:
 	{
 		return _func_list;
 	}
-	void AddPackage(std::string name, lua_State* state) {
-		this->packageStates[name] = state;
-		this->statePackages[state] = name;
+	int AddPackage(std::string name, lua_State* state);
+	void RemovePackage(std::string name);
+	int GetPackageId(const std::string& name) {
+		auto it = this->packageIds.find(name);
+		return it == this->packageIds.end() ? 0 : it->second;
+	}
+	int GetPackageId(const char* name) {
+		this->lookupKey.assign(name);
+		return this->GetPackageId(this->lookupKey);
 	}
-	void RemovePackage(std::string name) {
-		this->statePackages[this->packageStates[name]] = nullptr;
-		this->packageStates[name] = nullptr;
+	int GetPackageId(lua_State* L) {
+		auto it = this->statePackageIds.find(L);
+		if (it != this->statePackageIds.end())
+			return it->second;
+		// coroutines have their own lua_State, resolve them through the main thread of their package
+		it = this->statePackageIds.find(GetMainState(L));
+		return it == this->statePackageIds.end() ? 0 : it->second;
 	}
-	lua_State* GetPackageState(std::string name) {
-		return this->packageStates[name];
+	lua_State* GetPackageState(int packageId) {
+		if (packageId < 1 || packageId > (int)this->packages.size())
+			return nullptr;
+		return this->packages[packageId - 1].state;
+	}
+	lua_State* GetPackageState(const std::string& name) {
+		return this->GetPackageState(this->GetPackageId(name));
+	}
+	lua_State* GetPackageState(const char* name) {
+		return this->GetPackageState(this->GetPackageId(name));
 	}
 	std::string GetStatePackage(lua_State* L) {
-		return this->statePackages[L];
+		int packageId = this->GetPackageId(L);
+		if (packageId == 0)
+			return "";
+		return this->packages[packageId - 1].name;
+	}
+	bool LinkJavaAdapter(lua_State* L, int javaId, jclass clazz);
+	int GetEventId(const std::string& name);
+	void AddEventListener(lua_State* L, const std::string& name);
+	bool HasEventListeners(int eventId) {
+		if (this->untrackedPackages > 0)
+			return true;
+		if (eventId < 0 || eventId >= (int)this->eventListenerCounts.size())
+			return false;
+		return this->eventListenerCounts[eventId] > 0;
+	}
+	bool HasEventListeners(const std::string& name) {
+		auto it = this->eventIds.find(name);
+		if (it == this->eventIds.end())
+			return this->untrackedPackages > 0;
+		return this->HasEventListeners(it->second);
+	}
+	bool HasEventListeners(const char* name) {
+		this->lookupKey.assign(name);
+		return this->HasEventListeners(this->lookupKey);
 	}
 	int CreateJava(std::string classPath);
 	void DestroyJava(int id);
 	JavaEnv* GetJavaEnv(int id);
-	JavaEnv* FindJavaEnv(JNIEnv* jenv);
+	JavaEnv* FindJavaEnv(JNIEnv* jenv, jclass clazz);
+	static lua_State* GetMainState(lua_State* L);
+	int YieldForFuture(lua_State* L, int javaId, jobject future);
+	void FinishAsyncCall(int token);
+	void ResumeAsyncCalls();
+	void Tick(float deltaSeconds);
+	void CancelAsyncCalls(lua_State* owner);
 };
\ No newline at end of file
@@ -32,7 +32,7 @@ EXPORT(void) OnPluginStop()
 
 EXPORT(void) OnPluginTick(float DeltaSeconds)
 {
-	(void)DeltaSeconds;
+	Plugin::Get()->Tick(DeltaSeconds);
 }
 
 EXPORT(void) OnPackageLoad(const char *PackageName, lua_State *L)
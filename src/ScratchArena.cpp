@@ -0,0 +1,57 @@
+#include "ScratchArena.hpp"
+
+#include <algorithm>
+
+ScratchArena& ScratchArena::Get()
+{
+	static thread_local ScratchArena arena;
+	return arena;
+}
+
+void* ScratchArena::AllocateBytes(size_t size, size_t alignment)
+{
+	if (size == 0)
+		size = 1;
+	while (this->block < this->blocks.size()) {
+		Block& current = this->blocks[this->block];
+		size_t aligned = (this->offset + alignment - 1) & ~(alignment - 1);
+		if (aligned + size <= current.size) {
+			this->offset = aligned + size;
+			return current.data.get() + aligned;
+		}
+		this->block++;
+		this->offset = 0;
+	}
+	// only reached while warming up or for requests larger than any block so far
+	Block newBlock;
+	newBlock.size = std::max(BLOCK_SIZE, size);
+	newBlock.data.reset(new char[newBlock.size]);
+	this->blocks.push_back(std::move(newBlock));
+	this->block = this->blocks.size() - 1;
+	this->offset = size;
+	return this->blocks.back().data.get();
+}
+
+Lua::LuaArgs_t& ScratchArena::AcquireArgs()
+{
+	if (this->argsDepth == this->args.size())
+		this->args.emplace_back(new Lua::LuaArgs_t());
+	return *this->args[this->argsDepth++];
+}
+
+ScratchArena::Scope::Scope() : arena(ScratchArena::Get())
+{
+	this->block = this->arena.block;
+	this->offset = this->arena.offset;
+	this->argsDepth = this->arena.argsDepth;
+}
+
+ScratchArena::Scope::~Scope()
+{
+	// clear() keeps the capacity, but drops the lua values (and the references they hold) right away
+	for (size_t i = this->argsDepth; i < this->arena.argsDepth; i++)
+		this->arena.args[i]->clear();
+	this->arena.argsDepth = this->argsDepth;
+	this->arena.block = this->block;
+	this->arena.offset = this->offset;
+}
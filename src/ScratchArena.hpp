@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <PluginSDK.h>
+
+// Per-thread bump allocator for the temporaries of a bridge crossing (parameter arrays, jvalue buffers, argument lists).
+// Memory is kept after a crossing ends, so steady-state calls don't touch the heap.
+class ScratchArena
+{
+public:
+	// Marks the arena and rewinds to the mark when it goes out of scope.
+	// Crossings nest (lua -> java -> lua), each level opens its own scope.
+	class Scope
+	{
+	public:
+		Scope();
+		~Scope();
+	private:
+		ScratchArena& arena;
+		size_t block;
+		size_t offset;
+		size_t argsDepth;
+	};
+
+	static ScratchArena& Get();
+
+	// Memory is only valid until the enclosing scope ends and no destructors are run.
+	template<typename T>
+	T* Allocate(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "scratch memory is released without running destructors");
+		return static_cast<T*>(this->AllocateBytes(sizeof(T) * count, alignof(T)));
+	}
+	// Returns an empty argument list that is cleared again when the enclosing scope ends.
+	Lua::LuaArgs_t& AcquireArgs();
+
+private:
+	static const size_t BLOCK_SIZE = 64 * 1024;
+	struct Block
+	{
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+	std::vector<Block> blocks;
+	size_t block = 0;
+	size_t offset = 0;
+	std::vector<std::unique_ptr<Lua::LuaArgs_t>> args;
+	size_t argsDepth = 0;
+
+	void* AllocateBytes(size_t size, size_t alignment);
+};
@@ -0,0 +1,202 @@
+#include "Trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Trace
+{
+	static const size_t BUFFER_SIZE = 8192;
+
+	struct Record
+	{
+		const char* category;
+		int depth;
+		uint64_t start;
+		uint64_t duration;
+		uint64_t execution;
+		char name[64];
+	};
+
+	// sequence is the record's position + 1 once it is written, 0 while it is being overwritten
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence{ 0 };
+		Record record;
+	};
+
+	// single producer (the owning thread), single consumer (Flush, serialized by flushMutex)
+	// the producer never waits, once full it overwrites the oldest records so a flush shows the latest crossings
+	struct ThreadBuffer
+	{
+		uint32_t threadId;
+		std::atomic<uint64_t> head{ 0 };
+		uint64_t tail = 0;
+		Slot slots[BUFFER_SIZE];
+	};
+
+	static std::atomic<bool> enabled{ false };
+	static std::mutex buffersMutex;
+	static std::mutex flushMutex;
+	static std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	static thread_local std::shared_ptr<ThreadBuffer> threadBuffer;
+	static thread_local int currentDepth = 0;
+
+	static uint64_t Now()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static ThreadBuffer* GetThreadBuffer()
+	{
+		if (!threadBuffer) {
+			threadBuffer = std::make_shared<ThreadBuffer>();
+			std::lock_guard<std::mutex> lock(buffersMutex);
+			threadBuffer->threadId = (uint32_t)buffers.size() + 1;
+			buffers.push_back(threadBuffer);
+		}
+		return threadBuffer.get();
+	}
+
+	static void Push(const Record& record)
+	{
+		ThreadBuffer* buffer = GetThreadBuffer();
+		uint64_t head = buffer->head.load(std::memory_order_relaxed);
+		Slot& slot = buffer->slots[head % BUFFER_SIZE];
+		slot.sequence.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.record = record;
+		slot.sequence.store(head + 1, std::memory_order_release);
+		buffer->head.store(head + 1, std::memory_order_release);
+	}
+
+	void SetEnabled(bool value)
+	{
+		enabled.store(value, std::memory_order_relaxed);
+	}
+
+	bool IsEnabled()
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	static void WriteEscaped(std::ofstream& out, const char* str)
+	{
+		for (; *str; str++) {
+			unsigned char c = (unsigned char)*str;
+			if (c == '"' || c == '\\') {
+				out << '\\' << c;
+			}
+			else if (c < 0x20) {
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out << escaped;
+			}
+			else {
+				out << c;
+			}
+		}
+	}
+
+	int Flush(const std::string& path)
+	{
+		std::lock_guard<std::mutex> flushLock(flushMutex);
+		std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(buffersMutex);
+			snapshot = buffers;
+		}
+		std::ofstream out(path, std::ios::out | std::ios::trunc);
+		if (!out.is_open())
+			return -1;
+		int count = 0;
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		for (auto const& buffer : snapshot) {
+			uint64_t head = buffer->head.load(std::memory_order_acquire);
+			uint64_t first = head - buffer->tail > BUFFER_SIZE ? head - BUFFER_SIZE : buffer->tail;
+			uint64_t overwritten = first - buffer->tail;
+			for (uint64_t i = first; i < head; i++) {
+				Slot& slot = buffer->slots[i % BUFFER_SIZE];
+				if (slot.sequence.load(std::memory_order_acquire) != i + 1) {
+					overwritten++;
+					continue;
+				}
+				Record record = slot.record;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.sequence.load(std::memory_order_relaxed) != i + 1) {
+					// the producer wrapped around while the record was copied
+					overwritten++;
+					continue;
+				}
+				out << (count > 0 ? ",\n" : "\n") << "{\"name\":\"";
+				WriteEscaped(out, record.name);
+				out << "\",\"cat\":\"" << record.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+					<< ",\"ts\":" << (record.start / 1000) << "." << (record.start % 1000 / 100)
+					<< ",\"dur\":" << (record.duration / 1000) << "." << (record.duration % 1000 / 100)
+					<< ",\"args\":{\"depth\":" << record.depth
+					<< ",\"conversion_us\":" << ((record.duration - record.execution) / 1000)
+					<< ",\"execution_us\":" << (record.execution / 1000) << "}}";
+				count++;
+			}
+			buffer->tail = head;
+			if (overwritten > 0) {
+				out << (count > 0 ? ",\n" : "\n") << "{\"name\":\"overwritten\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" << buffer->threadId
+					<< ",\"ts\":" << (Now() / 1000) << ",\"args\":{\"records\":" << overwritten << "}}";
+			}
+		}
+		out << "\n]}\n";
+		return out.good() ? count : -1;
+	}
+
+	Scope::Scope(const char* category, const char* name, const char* detail)
+	{
+		this->active = IsEnabled();
+		if (!this->active)
+			return;
+		this->category = category;
+		if (detail != nullptr)
+			std::snprintf(this->name, sizeof(this->name), "%s.%s", name, detail);
+		else
+			std::snprintf(this->name, sizeof(this->name), "%s", name);
+		this->depth = currentDepth++;
+		this->executionStart = 0;
+		this->executionTime = 0;
+		this->start = Now();
+	}
+
+	Scope::~Scope()
+	{
+		if (!this->active)
+			return;
+		this->EndExecution();
+		currentDepth--;
+		Record record;
+		record.category = this->category;
+		record.depth = this->depth;
+		record.start = this->start;
+		record.duration = Now() - this->start;
+		record.execution = this->executionTime;
+		std::memcpy(record.name, this->name, sizeof(record.name));
+		Push(record);
+	}
+
+	void Scope::BeginExecution()
+	{
+		if (this->active)
+			this->executionStart = Now();
+	}
+
+	void Scope::EndExecution()
+	{
+		if (this->active && this->executionStart != 0) {
+			this->executionTime += Now() - this->executionStart;
+			this->executionStart = 0;
+		}
+	}
+}
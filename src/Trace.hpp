@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Records bridge crossings (lua->java and java->lua) into per-thread ring buffers
+// and writes them out as a Chrome trace (chrome://tracing, Perfetto) on demand.
+namespace Trace
+{
+	void SetEnabled(bool enabled);
+	bool IsEnabled();
+	// Writes the records collected since the last flush to path, at most the latest 8192 per thread. Returns the number of events written or -1.
+	int Flush(const std::string& path);
+
+	class Scope
+	{
+	public:
+		Scope(const char* category, const char* name, const char* detail = nullptr);
+		~Scope();
+		// Marks the part of the crossing spent in the callee, the rest counts as conversion time.
+		void BeginExecution();
+		void EndExecution();
+	private:
+		bool active;
+		const char* category;
+		int depth;
+		uint64_t start;
+		uint64_t executionStart;
+		uint64_t executionTime;
+		char name[64];
+	};
+}